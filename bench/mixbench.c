@@ -0,0 +1,223 @@
+/**
+ * Mixer benchmark: mixes N voices through source_processAllSources() without
+ * opening an audio device, and reports what a voice costs.
+ *
+ * usage: mixbench [voices] [file.ogg]
+ *
+ * A 12 second WAV is generated; OGG voices are only run when a file is given.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <SDL.h>
+
+#include "luax.h"
+#include "m_juno.h"
+#include "m_source.h"
+
+#define BLOCK 1024
+#define BLOCKS 400
+#define WAV_SECONDS 12
+#define PI 3.14159265358979323846
+
+typedef struct
+{
+    const char* name;
+    double rate, gain;
+    int loop;
+} Config;
+
+static const Config configs[] = {
+    { "rate 1.00 gain 1.0 loop  ", 1.00, 1.0, 1 },
+    { "rate 0.75 gain 0.5 loop  ", 0.75, 0.5, 1 },
+    { "rate 1.50 gain 0.5 loop  ", 1.50, 0.5, 1 },
+    { "rate 1.00 gain 0.5 noloop", 1.00, 0.5, 0 },
+};
+
+/* Creates the voices and leaves them in a table on the stack */
+static const char* setup =
+    "local str, n, rate, gain, loop = ...\n"
+    "local data = Data.fromString(str)\n"
+    "local voices = {}\n"
+    "for i = 1, n do\n"
+    "    local s = Source.fromData(data)\n"
+    "    s:setRate(rate)\n"
+    "    s:setGain(gain)\n"
+    "    s:setLoop(loop)\n"
+    "    s:play()\n"
+    "    voices[i] = s\n"
+    "end\n"
+    "return voices\n";
+
+static void write_u32(unsigned char* p, unsigned x)
+{
+    p[0] = x;
+    p[1] = x >> 8;
+    p[2] = x >> 16;
+    p[3] = x >> 24;
+}
+
+static unsigned char* make_wav(size_t* len)
+{
+    int sr = 44100;
+    int frames = sr * WAV_SECONDS;
+    unsigned size = frames * 4;
+    unsigned char* p = malloc(44 + size);
+    if(!p)
+    {
+        return NULL;
+    }
+    memcpy(p, "RIFF", 4);
+    write_u32(p + 4, 36 + size);
+    memcpy(p + 8, "WAVEfmt ", 8);
+    write_u32(p + 16, 16);
+    write_u32(p + 20, 1 | (2 << 16));
+    write_u32(p + 24, sr);
+    write_u32(p + 28, sr * 4);
+    write_u32(p + 32, 4 | (16 << 16));
+    memcpy(p + 36, "data", 4);
+    write_u32(p + 40, size);
+    /* A chord, so the resampler has real work to do */
+    for(int i = 0; i < frames; i++)
+    {
+        double t = (double)i / sr;
+        double x = sin(2 * PI * 220 * t) + 0.5 * sin(2 * PI * 330 * t)
+            + 0.25 * sin(2 * PI * 3520 * t);
+        int v = x * 10000;
+        p[44 + i * 4 + 0] = p[44 + i * 4 + 2] = v & 0xff;
+        p[44 + i * 4 + 1] = p[44 + i * 4 + 3] = (v >> 8) & 0xff;
+    }
+    *len = 44 + size;
+    return p;
+}
+
+static unsigned char* read_file(const char* filename, size_t* len)
+{
+    FILE* fp = fopen(filename, "rb");
+    if(!fp)
+    {
+        return NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    *len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    unsigned char* p = malloc(*len);
+    if(p && fread(p, 1, *len, fp) != *len)
+    {
+        free(p);
+        p = NULL;
+    }
+    fclose(fp);
+    return p;
+}
+
+static int compare(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void run(lua_State* L, const char* format, const Config* c,
+    const unsigned char* data, size_t len, int voices)
+{
+    static double times[BLOCKS];
+    double freq = SDL_GetPerformanceFrequency();
+
+    if(luaL_loadstring(L, setup) != 0)
+    {
+        fprintf(stderr, "%s\n", lua_tostring(L, -1));
+        exit(EXIT_FAILURE);
+    }
+    lua_pushlstring(L, (const char*)data, len);
+    lua_pushinteger(L, voices);
+    lua_pushnumber(L, c->rate);
+    lua_pushnumber(L, c->gain);
+    lua_pushboolean(L, c->loop);
+    if(lua_pcall(L, 5, 1, 0) != 0)
+    {
+        fprintf(stderr, "%s\n", lua_tostring(L, -1));
+        exit(EXIT_FAILURE);
+    }
+
+    /* Warm up: applies the commands and primes the raw buffers */
+    source_processCommands(L);
+    source_processAllSources(BLOCK * 2);
+
+    double decode = source_getDecodeTime();
+    double total = 0;
+    for(int i = 0; i < BLOCKS; i++)
+    {
+        Uint64 start = SDL_GetPerformanceCounter();
+        source_processCommands(L);
+        source_processAllSources(BLOCK * 2);
+        times[i] = (SDL_GetPerformanceCounter() - start) / freq;
+        total += times[i];
+    }
+    decode = source_getDecodeTime() - decode;
+
+    /* Report */
+    double samples = (double)BLOCKS * BLOCK * voices;
+    qsort(times, BLOCKS, sizeof(*times), compare);
+    printf("%-4s %s  %7.2f ns/sample/voice  (decode %6.2f, mix %6.2f)  "
+        "callback us: p50 %7.1f  p90 %7.1f  p99 %7.1f  max %7.1f\n",
+        format, c->name,
+        total * 1e9 / samples, decode * 1e9 / samples, (total - decode) * 1e9 / samples,
+        times[BLOCKS / 2] * 1e6, times[BLOCKS * 9 / 10] * 1e6,
+        times[BLOCKS * 99 / 100] * 1e6, times[BLOCKS - 1] * 1e6);
+
+    /* Destroy the voices */
+    lua_pop(L, 1);
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    source_processCommands(L);
+}
+
+int main(int argc, char** argv)
+{
+    int voices = argc > 1 ? atoi(argv[1]) : 32;
+    if(voices <= 0)
+    {
+        fprintf(stderr, "usage: mixbench [voices] [file.ogg]\n");
+        return EXIT_FAILURE;
+    }
+
+    size_t wavLen, oggLen = 0;
+    unsigned char* wav = make_wav(&wavLen);
+    unsigned char* ogg = NULL;
+    if(argc > 2 && !(ogg = read_file(argv[2], &oggLen)))
+    {
+        fprintf(stderr, "could not open file '%s'\n", argv[2]);
+        return EXIT_FAILURE;
+    }
+    if(!wav)
+    {
+        fprintf(stderr, "out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    lua_State* L = luaL_newstate();
+    luaL_openlibs(L);
+    luaopen_data(L);
+    lua_setglobal(L, "Data");
+    luaopen_source(L);
+    lua_setglobal(L, "Source");
+
+    printf("%d voices, %d blocks of %d samples at %dhz (%.1f us per block in realtime)\n",
+        voices, BLOCKS, BLOCK, source_getSamplerate(), BLOCK * 1e6 / source_getSamplerate());
+    int n = sizeof(configs) / sizeof(*configs);
+    for(int i = 0; i < n; i++)
+    {
+        run(L, "wav", &configs[i], wav, wavLen, voices);
+    }
+    for(int i = 0; ogg && i < n; i++)
+    {
+        run(L, "ogg", &configs[i], ogg, oggLen, voices);
+    }
+
+    lua_close(L);
+    free(wav);
+    free(ogg);
+    return EXIT_SUCCESS;
+}
@@ -25,7 +25,7 @@ def safename(filename):
     return re.sub(r'[^a-z0-9]', '_', os.path.basename(filename).lower())
 
 
-def process(filename):
+def process(filename, name=None):
     strings = []
 
     with open(filename, 'rb') as f:
@@ -36,7 +36,7 @@ def process(filename):
                 'static const char {name}[] = \n{array};',
                 {
                     'filename': os.path.basename(filename),
-                    'name': safename(filename),
+                    'name': safename(name or filename),
                     'array': make_array(data)
                 }
             )
@@ -48,11 +48,17 @@ def process(filename):
 def main():
     import sys
 
-    if len(sys.argv) < 2:
-        print("usage: embed filename")
+    args = sys.argv[1:]
+    name = None
+    if len(args) > 2 and args[0] == "--name":
+        name = args[1]
+        args = args[2:]
+
+    if len(args) < 1:
+        print("usage: embed [--name name] filename")
         sys.exit(1)
 
-    print(process(sys.argv[1]))
+    print(process(args[0], name))
 
 
 if __name__ == "__main__":
@@ -0,0 +1,117 @@
+import os, struct, sys, zlib
+
+# Writes a juno pack: a header, the entries sorted by the FNV-1a hash of their
+# name, a table of NUL-terminated names, then the payloads, each aligned to
+# 64 bytes so they can be used in place once the pack is mapped. The reader
+# lives in src/fs.c
+
+MAGIC = b"JPAK"
+VERSION = 1
+ALIGN = 64
+
+FDEFLATE = 1 << 0
+FDIR = 1 << 1
+
+HEADER = struct.Struct("<4sIII")
+ENTRY = struct.Struct("<IIIIQQQ")
+
+# Compressed payloads are only kept if they save at least this much
+MIN_SAVING = 0.1
+
+
+def fnv1a(s):
+    h = 2166136261
+    for c in s:
+        h = ((h ^ c) * 16777619) & 0xffffffff
+    return h
+
+
+def align(n):
+    return (n + ALIGN - 1) & ~(ALIGN - 1)
+
+
+def deflate(data):
+    c = zlib.compressobj(9, zlib.DEFLATED, -15)
+    return c.compress(data) + c.flush()
+
+
+def collect(root):
+    for dirpath, dirnames, filenames in os.walk(root):
+        dirnames.sort()
+        rel = os.path.relpath(dirpath, root).replace(os.sep, "/")
+        prefix = "" if rel == "." else rel + "/"
+        if prefix:
+            yield prefix[:-1], dirpath, True
+        for f in sorted(filenames):
+            yield prefix + f, os.path.join(dirpath, f), False
+
+
+def pack(root, output, compress=True):
+    entries = []
+    for name, path, isdir in collect(root):
+        e = {
+            "name": name.encode("utf-8"),
+            "flags": FDIR if isdir else 0,
+            "mtime": int(os.path.getmtime(path)) & 0xffffffff,
+            "data": b"",
+            "size": 0,
+        }
+        if not isdir:
+            with open(path, "rb") as f:
+                data = f.read()
+            e["size"] = len(data)
+            e["data"] = data
+            if compress and data:
+                c = deflate(data)
+                if len(c) <= len(data) * (1 - MIN_SAVING):
+                    e["data"] = c
+                    e["flags"] |= FDEFLATE
+        e["hash"] = fnv1a(e["name"])
+        entries.append(e)
+
+    # Payloads are laid out in directory order, the index is sorted by hash
+    names = b""
+    for e in entries:
+        e["nameOfs"] = len(names)
+        names += e["name"] + b"\0"
+    ofs = align(HEADER.size + ENTRY.size * len(entries) + len(names))
+    for e in entries:
+        e["offset"] = ofs
+        ofs = align(ofs + len(e["data"]))
+    index = sorted(entries, key=lambda e: (e["hash"], e["name"]))
+
+    with open(output, "wb") as f:
+        f.write(HEADER.pack(MAGIC, VERSION, len(entries), len(names)))
+        for e in index:
+            f.write(ENTRY.pack(e["hash"], e["nameOfs"], e["flags"], e["mtime"],
+                               e["offset"], len(e["data"]), e["size"]))
+        f.write(names)
+        for e in entries:
+            f.seek(e["offset"])
+            f.write(e["data"])
+        f.seek(0, os.SEEK_END)
+        f.write(b"\0" * (ofs - f.tell()))
+
+    return entries
+
+
+def main():
+    args = sys.argv[1:]
+    compress = True
+    if args and args[0] == "-0":
+        compress = False
+        args = args[1:]
+
+    if len(args) != 2 or not os.path.isdir(args[0]):
+        print("usage: pack [-0] directory output")
+        sys.exit(1)
+
+    entries = pack(args[0], args[1], compress)
+    files = [e for e in entries if not e["flags"] & FDIR]
+    print("%s: %d files, %d bytes (%d deflated)" % (
+        args[1], len(files), os.path.getsize(args[1]),
+        len([e for e in files if e["flags"] & FDEFLATE])))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,430 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "dsp.h"
+
+#define PI 3.14159265358979323846
+
+/* Freeverb's tunings at 44100hz, scaled to the actual samplerate */
+static const int combTuning[DSP_COMBS] = { 1116, 1188, 1277, 1356 };
+static const int allpassTuning[DSP_ALLPASSES] = { 556, 441 };
+#define REVERB_SPREAD 23
+
+/* Spectrum analysis: working buffers and tables for the last size used. Only
+ * ever used from the main thread */
+static float fftRe[DSP_FFT_MAX / 2], fftIm[DSP_FFT_MAX / 2];
+static float fftCos[DSP_FFT_MAX / 2], fftSin[DSP_FFT_MAX / 2];
+static float fftWindow[DSP_FFT_MAX];
+static int fftSize;
+
+static double clamp(double x, double a, double b)
+{
+    return x < a ? a : (x > b ? b : x);
+}
+
+/* Recursive parts of the effects decay towards zero forever; adding and
+ * removing a tiny offset flushes their tails to zero before they become
+ * denormals, which are very slow on most CPUs */
+static float undenormal(float x)
+{
+    x += 1e-18f;
+    x -= 1e-18f;
+    return x;
+}
+
+static void set_biquad(dsp_Effect* e)
+{
+    double cutoff = clamp(e->params.cutoff, 10, e->samplerate * 0.49);
+    double q = clamp(e->params.q, 0.1, 100);
+    double w = 2 * PI * cutoff / e->samplerate;
+    double cs = cos(w);
+    double alpha = sin(w) / (2 * q);
+    double b0, b1, b2;
+    switch(e->type)
+    {
+        default:
+        case DSP_LOWPASS:
+            b0 = (1 - cs) / 2;
+            b1 = 1 - cs;
+            b2 = (1 - cs) / 2;
+            break;
+        case DSP_HIGHPASS:
+            b0 = (1 + cs) / 2;
+            b1 = -(1 + cs);
+            b2 = (1 + cs) / 2;
+            break;
+        case DSP_BANDPASS:
+            b0 = alpha;
+            b1 = 0;
+            b2 = -alpha;
+            break;
+    }
+    double a0 = 1 + alpha;
+    e->b0 = b0 / a0;
+    e->b1 = b1 / a0;
+    e->b2 = b2 / a0;
+    e->a1 = (-2 * cs) / a0;
+    e->a2 = (1 - alpha) / a0;
+}
+
+static void process_biquad(dsp_Effect* e, float* buf, int len)
+{
+    int c, i;
+    for(c = 0; c < 2; c++)
+    {
+        float z1 = e->z1[c], z2 = e->z2[c];
+        for(i = c; i < len; i += 2)
+        {
+            float x = buf[i];
+            float y = e->b0 * x + z1;
+            z1 = e->b1 * x - e->a1 * y + z2;
+            z2 = e->b2 * x - e->a2 * y;
+            buf[i] = y;
+        }
+        e->z1[c] = undenormal(z1);
+        e->z2[c] = undenormal(z2);
+    }
+}
+
+static void process_delay(dsp_Effect* e, float* buf, int len)
+{
+    int i;
+    int pos = e->delayPos;
+    int tap = pos - e->delayFrames;
+    if(tap < 0)
+    {
+        tap += e->delayLen;
+    }
+    for(i = 0; i < len; i += 2)
+    {
+        float l = buf[i], r = buf[i + 1];
+        float dl = e->delay[tap * 2], dr = e->delay[tap * 2 + 1];
+        e->delay[pos * 2] = undenormal(l + dl * e->feedback);
+        e->delay[pos * 2 + 1] = undenormal(r + dr * e->feedback);
+        buf[i] = l * e->dry + dl * e->wet;
+        buf[i + 1] = r * e->dry + dr * e->wet;
+        if(++pos == e->delayLen)
+            pos = 0;
+        if(++tap == e->delayLen)
+            tap = 0;
+    }
+    e->delayPos = pos;
+}
+
+static void process_compressor(dsp_Effect* e, float* buf, int len)
+{
+    int i;
+    float env = e->env;
+    for(i = 0; i < len; i += 2)
+    {
+        /* Stereo-linked peak detector */
+        float l = buf[i], r = buf[i + 1];
+        float level = fabsf(l) > fabsf(r) ? fabsf(l) : fabsf(r);
+        level *= 1.0f / 32768;
+        float coef = level > env ? e->attack : e->release;
+        env = level + coef * (env - level);
+        /* Reduce everything over the threshold by the ratio */
+        float gain = e->makeup;
+        if(env > e->threshold)
+        {
+            gain *= powf(e->threshold / env, e->slope);
+        }
+        buf[i] = l * gain;
+        buf[i + 1] = r * gain;
+    }
+    e->env = undenormal(env);
+}
+
+static void process_reverb(dsp_Effect* e, float* buf, int len)
+{
+    int i, j, c;
+    for(i = 0; i < len; i += 2)
+    {
+        float in = (buf[i] + buf[i + 1]) * 0.015f;
+        float out[2] = { 0, 0 };
+        for(c = 0; c < 2; c++)
+        {
+            /* Parallel lowpass-feedback combs */
+            for(j = 0; j < DSP_COMBS; j++)
+            {
+                float* cb = e->comb[c][j];
+                int p = e->combPos[c][j];
+                float x = cb[p];
+                float store = x * (1 - e->damp) + e->combStore[c][j] * e->damp;
+                e->combStore[c][j] = undenormal(store);
+                cb[p] = undenormal(in + store * e->roomFeedback);
+                out[c] += x;
+                if(++p == e->combLen[c][j])
+                    p = 0;
+                e->combPos[c][j] = p;
+            }
+            /* Series allpasses */
+            for(j = 0; j < DSP_ALLPASSES; j++)
+            {
+                float* ap = e->allpass[c][j];
+                int p = e->allpassPos[c][j];
+                float x = ap[p];
+                ap[p] = undenormal(out[c] + x * 0.5f);
+                out[c] = x - out[c];
+                if(++p == e->allpassLen[c][j])
+                    p = 0;
+                e->allpassPos[c][j] = p;
+            }
+        }
+        buf[i] = buf[i] * e->dry + out[0] * e->wet;
+        buf[i + 1] = buf[i + 1] * e->dry + out[1] * e->wet;
+    }
+}
+
+static int init_reverb(dsp_Effect* e)
+{
+    int i, c;
+    int total = 0;
+    double scale = e->samplerate / 44100.0;
+    /* The right channel's lines are longer by the spread, and each line wraps
+     * at its own length so the two channels decorrelate as in Freeverb */
+    int spread = REVERB_SPREAD * scale;
+    for(c = 0; c < 2; c++)
+    {
+        for(i = 0; i < DSP_COMBS; i++)
+        {
+            e->combLen[c][i] = combTuning[i] * scale + c * spread;
+            total += e->combLen[c][i];
+        }
+        for(i = 0; i < DSP_ALLPASSES; i++)
+        {
+            e->allpassLen[c][i] = allpassTuning[i] * scale + c * spread;
+            total += e->allpassLen[c][i];
+        }
+    }
+    e->reverb = calloc(total, sizeof(*e->reverb));
+    if(!e->reverb)
+    {
+        return -1;
+    }
+    float* p = e->reverb;
+    for(c = 0; c < 2; c++)
+    {
+        for(i = 0; i < DSP_COMBS; i++)
+        {
+            e->comb[c][i] = p;
+            p += e->combLen[c][i];
+        }
+        for(i = 0; i < DSP_ALLPASSES; i++)
+        {
+            e->allpass[c][i] = p;
+            p += e->allpassLen[c][i];
+        }
+    }
+    return 0;
+}
+
+dsp_Effect* dsp_new(int type, const dsp_Params* p, int samplerate)
+{
+    dsp_Effect* e = calloc(1, sizeof(*e));
+    if(!e)
+    {
+        return NULL;
+    }
+    e->type = type;
+    e->samplerate = samplerate;
+    /* Allocate lines up front -- parameter changes happen on the audio thread,
+     * which must never allocate */
+    if(type == DSP_DELAY)
+    {
+        e->delayLen = DSP_DELAY_MAX * samplerate + 1;
+        e->delay = calloc(e->delayLen * 2, sizeof(*e->delay));
+        if(!e->delay)
+        {
+            free(e);
+            return NULL;
+        }
+    }
+    if(type == DSP_REVERB && init_reverb(e) != 0)
+    {
+        free(e);
+        return NULL;
+    }
+    dsp_setParams(e, p);
+    return e;
+}
+
+void dsp_destroy(dsp_Effect* e)
+{
+    if(!e)
+        return;
+    free(e->delay);
+    free(e->reverb);
+    free(e);
+}
+
+void dsp_setParams(dsp_Effect* e, const dsp_Params* p)
+{
+    double sr = e->samplerate;
+    e->params = *p;
+    switch(e->type)
+    {
+        case DSP_LOWPASS:
+        case DSP_HIGHPASS:
+        case DSP_BANDPASS:
+            set_biquad(e);
+            break;
+        case DSP_DELAY:
+            e->delayFrames = clamp(p->time * sr, 1, e->delayLen - 1);
+            e->feedback = clamp(p->feedback, 0, 0.99);
+            e->wet = clamp(p->mix, 0, 1);
+            e->dry = 1;
+            break;
+        case DSP_COMPRESSOR:
+            e->threshold = pow(10, p->threshold / 20);
+            e->slope = p->ratio > 1 ? 1 - 1 / p->ratio : 0;
+            e->attack = exp(-1 / (clamp(p->attack, 0.0001, 10) * sr));
+            e->release = exp(-1 / (clamp(p->release, 0.0001, 10) * sr));
+            e->makeup = pow(10, p->makeup / 20);
+            break;
+        case DSP_REVERB:
+            e->roomFeedback = 0.7 + 0.28 * clamp(p->size, 0, 1);
+            e->damp = 0.4 * clamp(p->damping, 0, 1);
+            e->wet = 3 * clamp(p->mix, 0, 1);
+            e->dry = 1 - clamp(p->mix, 0, 1);
+            break;
+    }
+}
+
+void dsp_process(dsp_Effect* e, float* buf, int len)
+{
+    switch(e->type)
+    {
+        case DSP_LOWPASS:
+        case DSP_HIGHPASS:
+        case DSP_BANDPASS:
+            process_biquad(e, buf, len);
+            break;
+        case DSP_DELAY:
+            process_delay(e, buf, len);
+            break;
+        case DSP_COMPRESSOR:
+            process_compressor(e, buf, len);
+            break;
+        case DSP_REVERB:
+            process_reverb(e, buf, len);
+            break;
+    }
+}
+
+int dsp_tail(const dsp_Effect* e)
+{
+    /* The longest stretch of silent output the effect can produce while it
+     * still holds something audible -- the gap before a delay's echo or a
+     * reverb's longest comb. The filters and compressor hold nothing that
+     * silence would hide */
+    int i, c;
+    int n = 0;
+    switch(e->type)
+    {
+        case DSP_DELAY:
+            n = e->delayFrames;
+            break;
+        case DSP_REVERB:
+            for(c = 0; c < 2; c++)
+            {
+                for(i = 0; i < DSP_COMBS; i++)
+                {
+                    if(e->combLen[c][i] > n)
+                        n = e->combLen[c][i];
+                }
+            }
+            break;
+    }
+    return n;
+}
+
+static void init_fft(int n)
+{
+    int i;
+    for(i = 0; i < n / 2; i++)
+    {
+        fftCos[i] = cos(2 * PI * i / n);
+        fftSin[i] = sin(2 * PI * i / n);
+    }
+    /* Hann window */
+    for(i = 0; i < n; i++)
+    {
+        fftWindow[i] = 0.5 - 0.5 * cos(2 * PI * i / n);
+    }
+    fftSize = n;
+}
+
+static void fft(float* re, float* im, int m, int n)
+{
+    /* In-place radix-2 complex FFT of size `m`, using the twiddles of size `n` */
+    int i, j, k, len;
+    for(i = 1, j = 0; i < m; i++)
+    {
+        int bit = m >> 1;
+        for(; j & bit; bit >>= 1)
+        {
+            j ^= bit;
+        }
+        j |= bit;
+        if(i < j)
+        {
+            float t = re[i]; re[i] = re[j]; re[j] = t;
+            t = im[i]; im[i] = im[j]; im[j] = t;
+        }
+    }
+    for(len = 2; len <= m; len <<= 1)
+    {
+        int half = len / 2;
+        int step = n / len;
+        for(i = 0; i < m; i += len)
+        {
+            for(k = 0; k < half; k++)
+            {
+                float wr = fftCos[k * step], wi = -fftSin[k * step];
+                float* ar = re + i + k;
+                float* ai = im + i + k;
+                float vr = ar[half] * wr - ai[half] * wi;
+                float vi = ar[half] * wi + ai[half] * wr;
+                ar[half] = *ar - vr;
+                ai[half] = *ai - vi;
+                *ar += vr;
+                *ai += vi;
+            }
+        }
+    }
+}
+
+void dsp_spectrum(const float* samples, float* bins, int n)
+{
+    /* Magnitudes of the Hann-windowed real FFT of `n` samples (a power of 2, at
+     * most DSP_FFT_MAX) into `n / 2` bins, scaled so a full-scale sine peaks
+     * near 1. The samples are packed into a complex FFT of half the size,
+     * which is then split into the spectrum of the real input */
+    int k;
+    int m = n / 2;
+    if(n != fftSize)
+    {
+        init_fft(n);
+    }
+    for(k = 0; k < m; k++)
+    {
+        fftRe[k] = samples[k * 2] * fftWindow[k * 2];
+        fftIm[k] = samples[k * 2 + 1] * fftWindow[k * 2 + 1];
+    }
+    fft(fftRe, fftIm, m, n);
+    float scale = 4.0f / n;
+    for(k = 0; k < m; k++)
+    {
+        int c = (m - k) & (m - 1);
+        float ar = fftRe[k], ai = fftIm[k];
+        float br = fftRe[c], bi = -fftIm[c];
+        /* Even and odd halves */
+        float er = (ar + br) * 0.5f, ei = (ai + bi) * 0.5f;
+        float odr = (ai - bi) * 0.5f, odi = (br - ar) * 0.5f;
+        float xr = er + fftCos[k] * odr + fftSin[k] * odi;
+        float xi = ei + fftCos[k] * odi - fftSin[k] * odr;
+        bins[k] = sqrtf(xr * xr + xi * xi) * scale;
+    }
+}
@@ -0,0 +1,62 @@
+#ifndef DSP_H
+#define DSP_H
+
+#define DSP_DELAY_MAX 2.0
+#define DSP_COMBS 4
+#define DSP_ALLPASSES 2
+#define DSP_FFT_MAX 4096
+
+enum
+{
+    DSP_LOWPASS,
+    DSP_HIGHPASS,
+    DSP_BANDPASS,
+    DSP_DELAY,
+    DSP_COMPRESSOR,
+    DSP_REVERB,
+};
+
+typedef struct
+{
+    /* Filters: cutoff in Hz */
+    double cutoff, q;
+    /* Delay: time in seconds; `mix` is also used by the reverb */
+    double time, feedback, mix;
+    /* Compressor: threshold and makeup in dB, attack and release in seconds */
+    double threshold, ratio, attack, release, makeup;
+    /* Reverb: both 0..1 */
+    double size, damping;
+} dsp_Params;
+
+typedef struct
+{
+    int type;
+    int samplerate;
+    dsp_Params params;
+    /* Biquad */
+    float b0, b1, b2, a1, a2;
+    float z1[2], z2[2];
+    /* Delay */
+    float* delay;
+    int delayLen, delayPos, delayFrames;
+    float feedback, wet, dry;
+    /* Compressor */
+    float env, attack, release, threshold, slope, makeup;
+    /* Reverb */
+    float* reverb;
+    float* comb[2][DSP_COMBS];
+    float* allpass[2][DSP_ALLPASSES];
+    int combLen[2][DSP_COMBS], combPos[2][DSP_COMBS];
+    int allpassLen[2][DSP_ALLPASSES], allpassPos[2][DSP_ALLPASSES];
+    float combStore[2][DSP_COMBS];
+    float roomFeedback, damp;
+} dsp_Effect;
+
+dsp_Effect* dsp_new(int type, const dsp_Params* p, int samplerate);
+void dsp_destroy(dsp_Effect* e);
+void dsp_setParams(dsp_Effect* e, const dsp_Params* p);
+void dsp_process(dsp_Effect* e, float* buf, int len);
+int dsp_tail(const dsp_Effect* e);
+void dsp_spectrum(const float* samples, float* bins, int n);
+
+#endif
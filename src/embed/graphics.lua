@@ -1,4 +1,5 @@
-local defaultFont = juno.Font.fromEmbedded()
+-- The default font is only loaded once something is printed with it
+local defaultFont
 
 local fontTexCache = {}
 setmetatable(fontTexCache, { 
@@ -9,7 +10,15 @@ setmetatable(fontTexCache, {
     __mode = "v",
 })
 
-local font = defaultFont
+local font
+
+local function getFont()
+    if not font then
+        defaultFont = defaultFont or juno.Font.fromEmbedded()
+        font = defaultFont
+    end
+    return font
+end
 
 function juno.graphics.setFont(newFont)
     font = newFont or defaultFont
@@ -25,6 +34,7 @@ function juno.graphics.print(text, x, y, r, sx, sy, ox, oy)
     ox = ox or 0
     oy = oy or 0
 
+    local font = getFont()
     if text:find("\n") then
         -- Multi line
         local height = font:getHeight()
@@ -15,6 +15,18 @@ local function merge(...)
     return res
 end
 
+-- Startup trace: with JUNO_TRACE_STARTUP set, the time each phase of startup
+-- took is written to stderr as it finishes, alongside juno.c's load time
+local traceLast = juno.timer.getTime()
+
+local function trace(phase)
+    if os.getenv("JUNO_TRACE_STARTUP") then
+        local now = juno.timer.getTime()
+        io.stderr:write(("startup: %-10s %8.3fms\n"):format(phase, (now - traceLast) * 1000))
+        traceLast = now
+    end
+end
+
 local doneOnError = false
 
 local function onError(msg)
@@ -87,6 +99,9 @@ local handlers = {
     filedropped = function(e)
         call(juno.filedropped, e.file)
     end,
+    fileread = function(e)
+        call(juno.fileread, e.id, e.data, e.error)
+    end,
     focus = function(e)
         call(juno.focus, e.focus)
     end,
@@ -145,13 +160,15 @@ function juno.errorhandler(msg)
 end
 
 -- Mount project paths
+trace("scripts")
 if juno.arg[2] then
     -- Try to mount all arguments as package
     for i=2, #juno.arg do
         juno.filesystem.mount(juno.arg[i])
     end
 else
-    -- Try to mount default packages (pak0, pak1, etc.)
+    -- Try to mount default packages (pak0, pak1, etc.): each may be a
+    -- directory, a zip or a pack made with pack.py
     local dirs = { juno.system.info("exedir") }
     if juno.system.info("os") == "osx" then
         table.insert(dirs, juno.system.info("exedir") .. "/../Resources")
@@ -165,20 +182,63 @@ else
     end
 end
 
--- Add filesystem-compatible package loader
-table.insert(package.loaders, 1, function(modname)
+-- Add filesystem-compatible package loader. Compiled modules are cached as
+-- bytecode in the write path, stamped with their source's modified time and
+-- size; the cache is used while the stamp still matches
+local bytecodeDir = ".cache/lua"
+local paths, pathsFrom
+
+local function findModule(modname)
+    -- Split the path once rather than on every require; misses are answered
+    -- by the filesystem's index without touching the disk
+    if pathsFrom ~= package.path then
+        paths, pathsFrom = {}, package.path
+        for x in package.path:gmatch("[^;]+") do
+            table.insert(paths, x)
+        end
+    end
     modname = modname:gsub("%.", "/")
-    for x in package.path:gmatch("[^;]+") do
+    for _, x in ipairs(paths) do
         local filename = x:gsub("?", modname)
         if juno.filesystem.exists(filename) then
-            return assert(loadstring(juno.filesystem.read(filename), "=" .. filename))
+            return filename
+        end
+    end
+end
+
+local function loadModule(filename)
+    local stamp = juno.filesystem.getModified(filename) .. " " ..
+                  juno.filesystem.getSize(filename) .. "\n"
+    local cached = bytecodeDir .. "/" .. filename:gsub("[/\\]", "%%") .. "c"
+    -- Fresh bytecode?
+    if juno.filesystem.exists(cached) then
+        local data = juno.filesystem.read(cached)
+        if data:sub(1, #stamp) == stamp then
+            local fn = loadstring(data:sub(#stamp + 1), "=" .. filename)
+            if fn then return fn end
         end
     end
+    local fn = assert(loadstring(juno.filesystem.read(filename), "=" .. filename))
+    -- Nothing is cached until there's a write path
+    pcall(function()
+        juno.filesystem.makeDirs(bytecodeDir)
+        juno.filesystem.write(cached, stamp .. string.dump(fn))
+    end)
+    return fn
+end
+
+table.insert(package.loaders, 1, function(modname)
+    local filename = findModule(modname)
+    if filename then
+        return loadModule(filename)
+    end
 end)
 
 -- Add extra package paths
 package.path = package.path .. ";?/init.lua"
 
+trace("mount")
+
 local c = {}
 if juno.filesystem.exists("conf.lua") then
     c = call(require, "conf")
@@ -189,6 +249,10 @@ local conf = merge({
     title       = "untitled",
     width       = 200,
     height      = 200,
+    -- Subsystems: false skips initing them; `audio` may also be a table of
+    -- options for juno.audio.init()
+    audio       = true,
+    joystick    = true,
 }, c)
 
 if conf.identity then
@@ -201,21 +265,33 @@ if conf.identity then
     juno.filesystem.mount(path)
 end
 
+trace("conf")
+
 juno.window.setTitle(conf.title)
 juno.graphics.init(conf.width, conf.height)
 juno.graphics.setClearColor(0, 0, 0)
-juno.audio.init()
-juno.joystick.init()
+trace("graphics")
+
+if conf.audio then
+    juno.audio.init(type(conf.audio) == "table" and conf.audio or nil)
+    trace("audio")
+end
 
 -- Open all of our joysticks and store them
 juno.joystick.joysticks = {}
-for i=0, juno.joystick.getCount()-1 do
-    table.insert(juno.joystick.joysticks, juno.joystick.open(i))
+if conf.joystick then
+    juno.joystick.init()
+    for i=0, juno.joystick.getCount()-1 do
+        table.insert(juno.joystick.joysticks, juno.joystick.open(i))
+    end
+    trace("joystick")
 end
 
 if juno.filesystem.exists("main.lua") then
     -- Load project file
     xpcall(function() require "main" end, onError)
+    trace("main.lua")
 end
 
-xpcall(function() call(juno.load) end, onError)
\ No newline at end of file
+xpcall(function() call(juno.load) end, onError)
+trace("load")
\ No newline at end of file
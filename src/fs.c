@@ -5,15 +5,27 @@
  * under the terms of the MIT license. See LICENSE for details.
  */
 
+/* posix_madvise(), realpath() and friends aren't declared under plain -std=c99 */
+#ifndef _WIN32
+#define _XOPEN_SOURCE 700
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <assert.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#if _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
 /* Force miniz.c to use regular fseek/ftell functions */
 #define fseeko fseek
 #define ftello ftell
@@ -22,6 +34,38 @@
 #include "miniz.c"
 #include "fs.h"
 
+/* Pack layout (see pack.py): a header, the entries sorted by the FNV-1a hash
+ * of their name, a table of NUL-terminated names, then the payloads, each
+ * aligned to PACK_ALIGN bytes. Everything is little endian */
+#define PACK_MAGIC "JPAK"
+#define PACK_VERSION 1
+#define PACK_ALIGN 64
+
+enum
+{
+    PACK_FDEFLATE = 1 << 0,
+    PACK_FDIR     = 1 << 1,
+};
+
+typedef struct
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t count;
+    uint32_t namesSize;
+} PackHeader;
+
+typedef struct
+{
+    uint32_t hash;
+    uint32_t nameOfs;
+    uint32_t flags;
+    uint32_t mtime;
+    uint64_t offset;
+    uint64_t compSize;
+    uint64_t size;
+} PackEntry;
+
 #if _WIN32
 #define mkdir(path, mode) mkdir(path)
 #endif
@@ -31,16 +75,67 @@ typedef struct PathNode
     struct PathNode* next;
     int type;
     mz_zip_archive zip;
+    /* The mapped archive, if it could be mapped */
+    struct fs_Region* region;
+    /* Packs: the index, inside the mapping */
+    const PackEntry* entries;
+    const char* names;
+    uint32_t count, namesSize;
     char path[1];
 } PathNode;
 
 static PathNode* mounts;
 static PathNode* writePath;
 
+/* Files smaller than this are read rather than mapped -- a mapping costs
+ * more than the read below a few pages */
+#define MAP_MIN_SIZE (64 * 1024)
+/* Smallest page size of the platforms we run on */
+#define PREFAULT_STEP 4096
+
+/* A read-only mapping of a whole file, shared by everything pointing into it */
+struct fs_Region
+{
+    void* base;
+    size_t size;
+    int refs;
+};
+
+/* Index of resolved paths: which mount a path was found on (and its index in
+ * a zip), or that it wasn't found anywhere. Each path has two lookups -- the
+ * first mount with anything at the path, which is what it reports as, and the
+ * first with a readable file there, which is what's read -- so a directory or
+ * unreadable file on a higher mount doesn't hide a file on a lower one. Filled
+ * as paths are looked up, cleared whenever the mounts change, and paths written
+ * through us are forgotten -- files changed behind our back on a mounted
+ * directory may be missed until then. Open addressing, never more than half
+ * full */
+enum
+{
+    LOOKUP_ANY,
+    LOOKUP_FILE,
+    LOOKUP_MAX
+};
+
+typedef struct
+{
+    char* name;
+    unsigned char known[LOOKUP_MAX];
+    PathNode* node[LOOKUP_MAX];
+    int idx[LOOKUP_MAX];
+} IndexEntry;
+
+#define INDEX_MAX 8192
+
+static IndexEntry* pathIndex;
+static int pathIndexSize;
+static int pathIndexCount;
+
 enum
 {
     PATH_TDIR,
-    PATH_TZIP
+    PATH_TZIP,
+    PATH_TPACK
 };
 
 static char* concat(const char* str, ...)
@@ -117,6 +212,46 @@ end:
     return err;
 }
 
+static fs_Region* mapRegion(const char* path, size_t size);
+static void releaseRegion(fs_Region* r);
+static void destroyNode(PathNode* p);
+
+static int isPack(const char* path)
+{
+    /* Checks the header; entries are bounds-checked as they're used */
+    PackHeader h;
+    struct stat s;
+    if(stat(path, &s) != 0 || !S_ISREG(s.st_mode))
+        return 0;
+    FILE* fp = fopen(path, "rb");
+    if(!fp)
+        return 0;
+    int res = fread(&h, sizeof(h), 1, fp) == 1 &&
+        !memcmp(h.magic, PACK_MAGIC, 4) && h.version == PACK_VERSION &&
+        sizeof(h) + (uint64_t)h.count * sizeof(PackEntry) + h.namesSize <= (uint64_t)s.st_size;
+    fclose(fp);
+    return res;
+}
+
+static int openPack(PathNode* p)
+{
+    /* Opening a pack is just mapping it: the index is used in place */
+    struct stat s;
+    if(stat(p->path, &s) != 0)
+        return FS_ECANTOPEN;
+    p->region = mapRegion(p->path, s.st_size);
+    if(!p->region)
+        return FS_ECANTOPEN;
+    const PackHeader* h = p->region->base;
+    p->entries = (const PackEntry*)(h + 1);
+    p->count = h->count;
+    p->names = (const char*)(p->entries + p->count);
+    p->namesSize = h->namesSize;
+    if(p->namesSize && p->names[p->namesSize - 1] != '\0')
+        return FS_EBADPATH;
+    return FS_ESUCCESS;
+}
+
 static PathNode* newNode(const char* path)
 {
     int res;
@@ -135,10 +270,33 @@ static PathNode* newNode(const char* path)
     {
         p->type = PATH_TDIR;
     }
+    else if(isPack(path))
+    {
+        p->type = PATH_TPACK;
+        if(openPack(p) != FS_ESUCCESS)
+        {
+            destroyNode(p);
+            return NULL;
+        }
+    }
     else
     {
+        /* Map the archive once, so entries can be served straight from the
+         * mapping; miniz falls back to reading the file if that fails */
+        struct stat s;
         p->type = PATH_TZIP;
-        res = mz_zip_reader_init_file(&p->zip, path, 0);
+        if(stat(path, &s) == 0 && s.st_size > 0)
+        {
+            p->region = mapRegion(path, s.st_size);
+        }
+        if(p->region)
+        {
+            res = mz_zip_reader_init_mem(&p->zip, p->region->base, p->region->size, 0);
+        }
+        else
+        {
+            res = mz_zip_reader_init_file(&p->zip, path, 0);
+        }
         assert(res);
     }
     return p;
@@ -150,9 +308,284 @@ static void destroyNode(PathNode* p)
     {
         mz_zip_reader_end(&p->zip);
     }
+    /* Anything still pointing into the archive keeps the mapping alive */
+    if(p->region)
+    {
+        releaseRegion(p->region);
+    }
     free(p);
 }
 
+static const char* packName(PathNode* p, const PackEntry* e)
+{
+    return (e->nameOfs < p->namesSize) ? p->names + e->nameOfs : "";
+}
+
+static unsigned hashString(const char* str);
+
+static int locatePack(PathNode* p, const char* filename)
+{
+    /* Binary search for the first entry with the name's hash, then compare
+     * names across any entries sharing it */
+    unsigned hash = hashString(filename);
+    uint32_t lo = 0, hi = p->count;
+    while(lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if(p->entries[mid].hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for(; lo < p->count && p->entries[lo].hash == hash; lo++)
+    {
+        if(!strcmp(packName(p, &p->entries[lo]), filename))
+            return lo;
+    }
+    return -1;
+}
+
+/* Returns the entry's payload inside the mapping, or NULL if it's a directory
+ * or out of bounds */
+static const void* packPayload(PathNode* p, int idx)
+{
+    const PackEntry* e = &p->entries[idx];
+    if(e->flags & PACK_FDIR)
+        return NULL;
+    if(!e->compSize)
+        return p->region->base;
+    if(e->offset > p->region->size || e->compSize > p->region->size - e->offset)
+        return NULL;
+    return (const char*)p->region->base + e->offset;
+}
+
+static int extractPackEntry(PathNode* p, int idx, void* dst, size_t size)
+{
+    const PackEntry* e = &p->entries[idx];
+    const void* src = packPayload(p, idx);
+    if(!src || e->size > size)
+        return FS_ECANTREAD;
+    if(e->flags & PACK_FDEFLATE)
+    {
+        size_t n = tinfl_decompress_mem_to_mem(dst, e->size, src, e->compSize, 0);
+        if(n != e->size)
+            return FS_ECANTREAD;
+    }
+    else
+    {
+        if(e->compSize != e->size)
+            return FS_ECANTREAD;
+        memcpy(dst, src, e->size);
+    }
+    return FS_ESUCCESS;
+}
+
+static unsigned hashString(const char* str)
+{
+    unsigned hash = 2166136261u;
+    while(*str)
+    {
+        hash = (hash ^ (unsigned char)*str++) * 16777619u;
+    }
+    return hash;
+}
+
+static void clearIndex(void)
+{
+    int i;
+    for(i = 0; i < pathIndexSize; i++)
+    {
+        free(pathIndex[i].name);
+    }
+    free(pathIndex);
+    pathIndex = NULL;
+    pathIndexSize = pathIndexCount = 0;
+}
+
+static IndexEntry* findEntry(const char* name)
+{
+    if(!pathIndex)
+        return NULL;
+    unsigned i = hashString(name) & (pathIndexSize - 1);
+    while(pathIndex[i].name)
+    {
+        if(!strcmp(pathIndex[i].name, name))
+            return &pathIndex[i];
+        i = (i + 1) & (pathIndexSize - 1);
+    }
+    return NULL;
+}
+
+static IndexEntry* addEntry(const char* name)
+{
+    /* Full? Start over rather than grow without bound from probing for
+     * missing files. Failing to add only means the lookup isn't cached */
+    if(pathIndexCount >= INDEX_MAX)
+    {
+        clearIndex();
+    }
+    if(!pathIndex)
+    {
+        pathIndex = calloc(INDEX_MAX * 2, sizeof(*pathIndex));
+        if(!pathIndex)
+            return NULL;
+        pathIndexSize = INDEX_MAX * 2;
+    }
+    char* str = concat(name, NULL);
+    if(!str)
+        return NULL;
+    unsigned i = hashString(name) & (pathIndexSize - 1);
+    while(pathIndex[i].name)
+    {
+        i = (i + 1) & (pathIndexSize - 1);
+    }
+    pathIndex[i].name = str;
+    pathIndexCount++;
+    return &pathIndex[i];
+}
+
+static int lookup(const char* filename, int type, PathNode** node, int* idx)
+{
+    /* Finds the highest priority mount containing `filename` -- or, for
+     * LOOKUP_FILE, containing a file we can read there; `idx` is set to the
+     * entry's index for zips and packs */
+    IndexEntry* e = findEntry(filename);
+    if(e && e->known[type])
+    {
+        *node = e->node[type];
+        *idx = e->idx[type];
+        return *node ? FS_ESUCCESS : FS_ENOTEXIST;
+    }
+    PathNode* p = mounts;
+    *idx = -1;
+    while(p)
+    {
+        if(p->type == PATH_TDIR)
+        {
+            struct stat s;
+            char* r = concat(p->path, "/", filename, NULL);
+            if(!r)
+                return FS_EOUTOFMEM;
+            int res = stat(r, &s);
+            if(res == 0 && type == LOOKUP_FILE)
+            {
+                res = (S_ISREG(s.st_mode) && access(r, R_OK) == 0) ? 0 : -1;
+            }
+            free(r);
+            if(res == 0)
+                break;
+        }
+        else if(p->type == PATH_TZIP)
+        {
+            *idx = mz_zip_reader_locate_file(&p->zip, filename, NULL, 0);
+            if(*idx != -1 && (type != LOOKUP_FILE
+                || !mz_zip_reader_is_file_a_directory(&p->zip, *idx)))
+                break;
+        }
+        else if(p->type == PATH_TPACK)
+        {
+            *idx = locatePack(p, filename);
+            if(*idx != -1 && (type != LOOKUP_FILE
+                || !(p->entries[*idx].flags & PACK_FDIR)))
+                break;
+        }
+        *idx = -1;
+        p = p->next;
+    }
+    if(e || (e = addEntry(filename)))
+    {
+        e->known[type] = 1;
+        e->node[type] = p;
+        e->idx[type] = *idx;
+    }
+    *node = p;
+    return p ? FS_ESUCCESS : FS_ENOTEXIST;
+}
+
+static int resolve(const char* filename, PathNode** node, int* idx)
+{
+    return lookup(filename, LOOKUP_ANY, node, idx);
+}
+
+static int resolveFile(const char* filename, PathNode** node, int* idx)
+{
+    return lookup(filename, LOOKUP_FILE, node, idx);
+}
+
+static fs_Region* mapRegion(const char* path, size_t size)
+{
+    void* base = NULL;
+#if _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(file == INVALID_HANDLE_VALUE)
+        return NULL;
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if(mapping)
+    {
+        base = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, size);
+        CloseHandle(mapping);
+    }
+    CloseHandle(file);
+#else
+    int fd = open(path, O_RDONLY);
+    if(fd == -1)
+        return NULL;
+    base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED)
+        base = NULL;
+#endif
+    if(!base)
+        return NULL;
+    fs_Region* r = malloc(sizeof(*r));
+    if(!r)
+    {
+#if _WIN32
+        UnmapViewOfFile(base);
+#else
+        munmap(base, size);
+#endif
+        return NULL;
+    }
+    r->base = base;
+    r->size = size;
+    r->refs = 1;
+    return r;
+}
+
+static void releaseRegion(fs_Region* r)
+{
+    if(--r->refs > 0)
+        return;
+#if _WIN32
+    UnmapViewOfFile(r->base);
+#else
+    munmap(r->base, r->size);
+#endif
+    free(r);
+}
+
+static void prefault(const void* data, size_t size)
+{
+    /* Brings a mapped range into memory by reading a byte of every page, so the
+     * thread that gets the mapping doesn't stall on the disk when it first
+     * touches it */
+    const volatile unsigned char* p = data;
+    if(size == 0)
+        return;
+#if !_WIN32
+    size_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)data & ~(uintptr_t)(page - 1);
+    posix_madvise((void*)start, (uintptr_t)data + size - start, POSIX_MADV_WILLNEED);
+#endif
+    for(size_t i = 0; i < size; i += PREFAULT_STEP)
+    {
+        (void)p[i];
+    }
+    (void)p[size - 1];
+}
+
 static int checkFilename(const char* filename)
 {
     if(*filename == '/' || strstr(filename, "..") || strstr(filename, ":\\"))
@@ -171,6 +604,73 @@ static const char* skipDotSlash(const char* filename)
     return filename;
 }
 
+static void forgetEntry(const char* name, int missingOnly)
+{
+    IndexEntry* e = findEntry(name);
+    if(!e)
+        return;
+    for(int i = 0; i < LOOKUP_MAX; i++)
+    {
+        if(!missingOnly || !e->node[i])
+        {
+            e->known[i] = 0;
+        }
+    }
+}
+
+static void forgetPath(const char* name)
+{
+    /* Forgets the lookups of `name` and those of its parent directories that
+     * found nothing, as a write may have created them */
+    char* str = concat(name, NULL);
+    if(!str)
+    {
+        clearIndex();
+        return;
+    }
+    forgetEntry(str, 0);
+    for(char* p = str + strlen(str); p > str; p--)
+    {
+        if(*p == '/')
+        {
+            *p = '\0';
+            forgetEntry(str, 1);
+        }
+    }
+    free(str);
+}
+
+static void forgetWritten(const char* filename)
+{
+    /* Called for a path in the write path that is about to change. The write
+     * path is usually mounted as-is, but may also sit inside a mounted
+     * directory, where the file goes by a longer name */
+    filename = skipDotSlash(filename);
+    size_t len = strlen(writePath->path);
+    for(PathNode* p = mounts; p; p = p->next)
+    {
+        if(p->type != PATH_TDIR)
+            continue;
+        size_t n = strlen(p->path);
+        if(n == len && !strcmp(p->path, writePath->path))
+        {
+            forgetPath(filename);
+        }
+        else if(n < len && !strncmp(p->path, writePath->path, n)
+            && writePath->path[n] == '/')
+        {
+            char* name = concat(writePath->path + n + 1, "/", filename, NULL);
+            if(!name)
+            {
+                clearIndex();
+                return;
+            }
+            forgetPath(name);
+            free(name);
+        }
+    }
+}
+
 const char* fs_errorStr(int err)
 {
     switch(err)
@@ -206,6 +706,7 @@ const char* fs_errorStr(int err)
 
 void fs_deinit(void)
 {
+    clearIndex();
     while(mounts)
     {
         PathNode *p = mounts->next;
@@ -224,7 +725,7 @@ int fs_mount(const char* path)
     /* Check if path is valid directory or archive */
     mz_zip_archive zip;
     memset(&zip, 0, sizeof(zip));
-    if(!isDir(path) && !mz_zip_reader_init_file(&zip, path, 0))
+    if(!isDir(path) && !isPack(path) && !mz_zip_reader_init_file(&zip, path, 0))
     {
         return FS_EBADPATH;
     }
@@ -246,6 +747,7 @@ int fs_mount(const char* path)
     /* Add to start of list (highest priority) */
     p->next = mounts;
     mounts = p;
+    clearIndex();
     return FS_ESUCCESS;
 }
 
@@ -259,6 +761,7 @@ int fs_unmount(const char *path)
             PathNode *p = *next;
             *next = (*next)->next;
             destroyNode(p);
+            clearIndex();
             break;
         }
         next = &(*next)->next;
@@ -281,6 +784,7 @@ int fs_setWritePath(const char* path)
         destroyNode(writePath);
     }
     writePath = p;
+    clearIndex();
     return FS_ESUCCESS;
 }
 
@@ -290,52 +794,59 @@ static int fileInfo(
     if(checkFilename(filename) != FS_ESUCCESS)
         return FS_EBADFILENAME;
     filename = skipDotSlash(filename);
-    PathNode* p = mounts;
-    while(p)
+    PathNode* p;
+    int idx;
+    int err = resolve(filename, &p, &idx);
+    if(err)
+        return err;
+    if(p->type == PATH_TDIR)
     {
-        if(p->type == PATH_TDIR)
+        struct stat s;
+        char* r = concat(p->path, "/", filename, NULL);
+        if(!r)
+            return FS_EOUTOFMEM;
+        int res = stat(r, &s);
+        free(r);
+        if(res != 0)
         {
-            struct stat s;
-            char* r = concat(p->path, "/", filename, NULL);
-            if(!r)
-                return FS_EOUTOFMEM;
-            int res = stat(r, &s);
-            free(r);
-            if(res == 0)
-            {
-                if(mtime)
-                    *mtime = s.st_mtime;
-                if(size)
-                    *size = s.st_size;
-                if(isdir)
-                    *isdir = S_ISDIR(s.st_mode);
-                return 0;
-            }
+            /* Gone since it was indexed */
+            forgetPath(filename);
+            return FS_ENOTEXIST;
         }
-        else if(p->type == PATH_TZIP)
+        if(mtime)
+            *mtime = s.st_mtime;
+        if(size)
+            *size = s.st_size;
+        if(isdir)
+            *isdir = S_ISDIR(s.st_mode);
+    }
+    else if(p->type == PATH_TPACK)
+    {
+        const PackEntry* e = &p->entries[idx];
+        if(mtime)
+            *mtime = e->mtime;
+        if(size)
+            *size = e->size;
+        if(isdir)
+            *isdir = (e->flags & PACK_FDIR) != 0;
+    }
+    else
+    {
+        if(mtime || size)
         {
-            int idx = mz_zip_reader_locate_file(&p->zip, filename, NULL, 0);
-            if(idx != -1)
-            {
-                if(mtime || size)
-                {
-                    mz_zip_archive_file_stat s;
-                    mz_zip_reader_file_stat(&p->zip, idx, &s);
-                    if(mtime)
-                        *mtime = s.m_time;
-                    if(size)
-                        *size = s.m_uncomp_size;
-                }
-                if(isdir)
-                {
-                    *isdir = mz_zip_reader_is_file_a_directory(&p->zip, idx);
-                }
-                return 0;
-            }
+            mz_zip_archive_file_stat s;
+            mz_zip_reader_file_stat(&p->zip, idx, &s);
+            if(mtime)
+                *mtime = s.m_time;
+            if(size)
+                *size = s.m_uncomp_size;
+        }
+        if(isdir)
+        {
+            *isdir = mz_zip_reader_is_file_a_directory(&p->zip, idx);
         }
-        p = p->next;
     }
-    return FS_ENOTEXIST;
+    return FS_ESUCCESS;
 }
 
 int fs_exists(const char* filename)
@@ -353,6 +864,117 @@ int fs_size(const char* filename, size_t* size)
     return fileInfo(filename, NULL, size, NULL);
 }
 
+/* Returns a pointer to an entry's payload inside the archive's mapping, raw
+ * deflate if `deflated` is set, or NULL if the archive isn't mapped or the entry
+ * can't be used as is */
+static const void* entryPayload(
+    PathNode* p, int idx, size_t* compSize, size_t* size, int* deflated)
+{
+    if(p->type == PATH_TPACK)
+    {
+        const PackEntry* e = &p->entries[idx];
+        *deflated = (e->flags & PACK_FDEFLATE) != 0;
+        if(!*deflated && e->compSize != e->size)
+            return NULL;
+        *compSize = e->compSize;
+        *size = e->size;
+        return packPayload(p, idx);
+    }
+    mz_zip_archive_file_stat st;
+    if(!p->region || !mz_zip_reader_file_stat(&p->zip, idx, &st))
+        return NULL;
+    if((st.m_method != 0 && st.m_method != MZ_DEFLATED) ||
+       (st.m_method == 0 && st.m_comp_size != st.m_uncomp_size) ||
+       (st.m_bit_flag & (1 | 32)) || mz_zip_reader_is_file_a_directory(&p->zip, idx))
+    {
+        return NULL;
+    }
+    const mz_uint8* base = p->region->base;
+    mz_uint64 ofs = st.m_local_header_ofs;
+    if(ofs + MZ_ZIP_LOCAL_DIR_HEADER_SIZE > p->region->size ||
+       MZ_READ_LE32(base + ofs) != MZ_ZIP_LOCAL_DIR_HEADER_SIG)
+    {
+        return NULL;
+    }
+    ofs += MZ_ZIP_LOCAL_DIR_HEADER_SIZE +
+        MZ_READ_LE16(base + ofs + MZ_ZIP_LDH_FILENAME_LEN_OFS) +
+        MZ_READ_LE16(base + ofs + MZ_ZIP_LDH_EXTRA_LEN_OFS);
+    if(ofs + st.m_comp_size > p->region->size)
+        return NULL;
+    *deflated = st.m_method == MZ_DEFLATED;
+    *compSize = st.m_comp_size;
+    *size = st.m_uncomp_size;
+    return base + ofs;
+}
+
+static const void* storedEntry(PathNode* p, int idx, size_t* size)
+{
+    size_t compSize;
+    int deflated;
+    const void* data = entryPayload(p, idx, &compSize, size, &deflated);
+    return deflated ? NULL : data;
+}
+
+/* Reads a whole file into a heap buffer with a terminating NUL */
+static char* readFile(const char* path, size_t* len)
+{
+    FILE* fp = fopen(path, "rb");
+    if(!fp)
+        return NULL;
+    /* Get file size */
+    fseek(fp, 0, SEEK_END);
+    *len = ftell(fp);
+    /* Load file */
+    fseek(fp, 0, SEEK_SET);
+    char* res = malloc(*len + 1);
+    if(!res)
+    {
+        fclose(fp);
+        return NULL;
+    }
+    res[*len] = '\0';
+    if(fread(res, 1, *len, fp) != *len)
+    {
+        free(res);
+        fclose(fp);
+        return NULL;
+    }
+    fclose(fp);
+    return res;
+}
+
+/* Extracts a zip or pack entry into a heap buffer of exactly its size (plus a
+ * terminating NUL); compressed entries are inflated straight into it */
+static void* readEntry(PathNode* p, int idx, size_t* len)
+{
+    size_t size;
+    mz_zip_archive_file_stat st;
+    if(p->type == PATH_TPACK)
+    {
+        size = p->entries[idx].size;
+    }
+    else
+    {
+        if(!mz_zip_reader_file_stat(&p->zip, idx, &st))
+            return NULL;
+        size = st.m_uncomp_size;
+    }
+    char* res = malloc(size + 1);
+    if(!res)
+        return NULL;
+    int ok = (p->type == PATH_TPACK)
+        ? extractPackEntry(p, idx, res, size) == FS_ESUCCESS
+        : mz_zip_reader_extract_to_mem(&p->zip, idx, res, size, 0);
+    if(!ok)
+    {
+        free(res);
+        return NULL;
+    }
+    res[size] = '\0';
+    *len = size;
+    return res;
+}
+
 void* fs_read(const char* filename, size_t* len)
 {
     size_t len_ = 0;
@@ -361,49 +983,567 @@ void* fs_read(const char* filename, size_t* len)
     if(checkFilename(filename) != FS_ESUCCESS)
         return NULL;
     filename = skipDotSlash(filename);
-    PathNode* p = mounts;
-    while(p)
+    PathNode* p;
+    int idx;
+    if(resolveFile(filename, &p, &idx) != FS_ESUCCESS)
+        return NULL;
+    if(p->type != PATH_TDIR)
     {
-        if(p->type == PATH_TDIR)
+        return readEntry(p, idx, len);
+    }
+    char* r = concat(p->path, "/", filename, NULL);
+    if(!r)
+        return NULL;
+    char* res = readFile(r, len);
+    free(r);
+    if(!res)
+    {
+        forgetPath(filename);
+    }
+    return res;
+}
+
+static char* fullPath(const char* path)
+{
+    /* Absolute form of an existing path with `.`, `..` and (on POSIX) symlinks
+     * resolved, so two paths naming the same file compare equal */
+#if _WIN32
+    char buf[MAX_PATH];
+    DWORD n = GetFullPathNameA(path, MAX_PATH, buf, NULL);
+    if(n == 0 || n >= MAX_PATH)
+        return NULL;
+    for(char* p = buf; *p; p++)
+    {
+        if(*p == '\\')
+            *p = '/';
+    }
+    return concat(buf, NULL);
+#else
+    return realpath(path, NULL);
+#endif
+}
+
+static int isWritable(const char* path)
+{
+    /* Whether `path` is inside the write path, where we may overwrite it. Both
+     * are resolved first: a mount can reach the write path through a symlink
+     * or a `..`, and Windows paths differ in case and separators. If either
+     * can't be resolved we assume it is, as reading is always safe */
+    if(!writePath)
+        return 0;
+    char* dir = fullPath(writePath->path);
+    char* file = fullPath(path);
+    int res = 1;
+    if(dir && file)
+    {
+        size_t n = strlen(dir);
+#if _WIN32
+        res = !_strnicmp(file, dir, n);
+#else
+        res = !strncmp(file, dir, n);
+#endif
+        res = res && (file[n] == '/' || (n > 0 && dir[n - 1] == '/'));
+    }
+    free(dir);
+    free(file);
+    return res;
+}
+
+/* Maps a file on disk if it's large enough to be worth it, otherwise reads it.
+ * Files we may write to are always read: rewriting a mapped file would fault
+ * the mapping's holder on POSIX and fail on Windows. Touches no shared state,
+ * so it's safe on any thread */
+static int mapFile(const char* path, int writable, fs_Map* map)
+{
+    struct stat s;
+    if(stat(path, &s) != 0 || !S_ISREG(s.st_mode))
+        return FS_ECANTOPEN;
+    if(s.st_size >= MAP_MIN_SIZE && !writable)
+    {
+        map->region = mapRegion(path, s.st_size);
+    }
+    if(map->region)
+    {
+        map->data = map->region->base;
+        map->size = map->region->size;
+        return FS_ESUCCESS;
+    }
+    map->data = readFile(path, &map->size);
+    return map->data ? FS_ESUCCESS : FS_ECANTREAD;
+}
+
+int fs_map(const char* filename, fs_Map* map)
+{
+    /* Large files on directory mounts and stored archive entries are served from
+     * a mapping, so their pages come from the OS's cache as they're touched;
+     * everything else is read, including anything in the write path. A mapped
+     * file must not be truncated while the mapping lives */
+    memset(map, 0, sizeof(*map));
+    if(checkFilename(filename) != FS_ESUCCESS)
+        return FS_EBADFILENAME;
+    const char* name = skipDotSlash(filename);
+    PathNode* p;
+    int idx;
+    int err = resolveFile(name, &p, &idx);
+    if(err)
+        return err;
+    if(p->type == PATH_TDIR)
+    {
+        char* r = concat(p->path, "/", name, NULL);
+        if(!r)
+            return FS_EOUTOFMEM;
+        err = mapFile(r, isWritable(r), map);
+        free(r);
+        if(err)
+        {
+            forgetPath(name);
+        }
+        return err;
+    }
+    const void* data = storedEntry(p, idx, &map->size);
+    if(data)
+    {
+        map->data = (void*)data;
+        map->region = p->region;
+        map->region->refs++;
+        return FS_ESUCCESS;
+    }
+    map->data = readEntry(p, idx, &map->size);
+    return map->data ? FS_ESUCCESS : FS_ECANTREAD;
+}
+
+void fs_unmap(fs_Map* map)
+{
+    if(map->region)
+    {
+        releaseRegion(map->region);
+    }
+    else
+    {
+        free(map->data);
+    }
+    memset(map, 0, sizeof(*map));
+}
+
+/* Reads split in three so the I/O can run on another thread: fs_openRead()
+ * resolves the file and holds on to the archive's mapping, fs_performRead()
+ * reads and inflates without touching anything shared, and fs_closeRead()
+ * lets go. Opening and closing must happen on the thread using the rest of fs */
+struct fs_Read
+{
+    char* path;
+    fs_Region* region;
+    const void* src;
+    size_t compSize, size;
+    int deflated;
+    int writable;
+    /* Entries of archives that couldn't be mapped are read when opened */
+    void* data;
+};
+
+int fs_openRead(const char* filename, fs_Read** read)
+{
+    *read = NULL;
+    if(checkFilename(filename) != FS_ESUCCESS)
+        return FS_EBADFILENAME;
+    filename = skipDotSlash(filename);
+    PathNode* p;
+    int idx;
+    int err = resolveFile(filename, &p, &idx);
+    if(err)
+        return err;
+    fs_Read* r = calloc(1, sizeof(*r));
+    if(!r)
+        return FS_EOUTOFMEM;
+    if(p->type == PATH_TDIR)
+    {
+        r->path = concat(p->path, "/", filename, NULL);
+        if(!r->path)
         {
-            char* r = concat(p->path, "/", filename, NULL);
-            if(!r)
-                return NULL;
-            FILE* fp = fopen(r, "rb");
             free(r);
-            if(!fp)
-                goto next;
-            /* Get file size */
-            fseek(fp, 0, SEEK_END);
-            *len = ftell(fp);
-            /* Load file */
-            fseek(fp, 0, SEEK_SET);
-            char* res = malloc(*len + 1);
-            if(!res)
-                return NULL;
-            res[*len] = '\0';
-            if(fread(res, 1, *len, fp) != *len)
-            {
-                free(res);
-                fclose(fp);
-                return NULL;
-            }
+            return FS_EOUTOFMEM;
+        }
+        r->writable = isWritable(r->path);
+    }
+    else
+    {
+        r->src = entryPayload(p, idx, &r->compSize, &r->size, &r->deflated);
+        if(r->src)
+        {
+            r->region = p->region;
+            r->region->refs++;
+        }
+        else if(!(r->data = readEntry(p, idx, &r->size)))
+        {
+            free(r);
+            return FS_ECANTREAD;
+        }
+    }
+    *read = r;
+    return FS_ESUCCESS;
+}
+
+int fs_performRead(fs_Read* r, fs_Map* map)
+{
+    /* Safe on any thread; call at most once per fs_Read. Mapped results are
+     * prefaulted so the I/O happens here rather than on first use */
+    memset(map, 0, sizeof(*map));
+    if(r->data)
+    {
+        map->data = r->data;
+        map->size = r->size;
+        r->data = NULL;
+        return FS_ESUCCESS;
+    }
+    if(r->path)
+    {
+        int err = mapFile(r->path, r->writable, map);
+        if(!err && map->region)
+        {
+            prefault(map->data, map->size);
+        }
+        return err;
+    }
+    if(!r->deflated)
+    {
+        /* The reference on the mapping moves to `map` */
+        prefault(r->src, r->size);
+        map->data = (void*)r->src;
+        map->size = r->size;
+        map->region = r->region;
+        r->region = NULL;
+        return FS_ESUCCESS;
+    }
+    char* dst = malloc(r->size + 1);
+    if(!dst)
+        return FS_EOUTOFMEM;
+    if(tinfl_decompress_mem_to_mem(dst, r->size, r->src, r->compSize, 0) != r->size)
+    {
+        free(dst);
+        return FS_ECANTREAD;
+    }
+    dst[r->size] = '\0';
+    map->data = dst;
+    map->size = r->size;
+    return FS_ESUCCESS;
+}
+
+void fs_closeRead(fs_Read* r)
+{
+    if(r->region)
+    {
+        releaseRegion(r->region);
+    }
+    free(r->data);
+    free(r->path);
+    free(r);
+}
+
+#define STREAM_INBUF_SIZE 4096
+
+/* Write streams are fully buffered by stdio in chunks this big, so small writes
+ * don't each reach the OS */
+#define STREAM_WRITEBUF_SIZE (64 * 1024)
+
+enum
+{
+    STREAM_READ,
+    STREAM_WRITE,
+    STREAM_APPEND
+};
+
+struct fs_Stream
+{
+    int type;
+    int mode;
+    FILE* fp;
+    size_t size;
+    size_t pos;
+    /* Zip and pack entries -- the stream keeps its own handle on the archive
+     * file so it never shares the mount's seek position */
+    int method;
+    size_t dataOfs;
+    size_t compSize;
+    size_t compPos;
+    tinfl_decompressor inflator;
+    mz_uint8* inBuf;
+    size_t inOfs, inAvail;
+    mz_uint8* dict;
+    size_t dictOfs, dictAvail;
+};
+
+static int initInflate(fs_Stream* s)
+{
+    if(s->method == MZ_DEFLATED)
+    {
+        s->inBuf = malloc(STREAM_INBUF_SIZE);
+        s->dict = malloc(TINFL_LZ_DICT_SIZE);
+        if(!s->inBuf || !s->dict)
+            return FS_EOUTOFMEM;
+        tinfl_init(&s->inflator);
+    }
+    return FS_ESUCCESS;
+}
+
+static int openZipEntry(fs_Stream* s, PathNode* p, int idx)
+{
+    mz_zip_archive_file_stat st;
+    mz_uint8 header[MZ_ZIP_LOCAL_DIR_HEADER_SIZE];
+    if(!mz_zip_reader_file_stat(&p->zip, idx, &st))
+        return FS_ECANTREAD;
+    if((st.m_bit_flag & (1 | 32)) || (st.m_method != 0 && st.m_method != MZ_DEFLATED))
+        return FS_ECANTREAD;
+    s->fp = fopen(p->path, "rb");
+    if(!s->fp)
+        return FS_ECANTOPEN;
+    /* Skip the local header to find the start of the entry's data */
+    fseek(s->fp, st.m_local_header_ofs, SEEK_SET);
+    if(fread(header, 1, sizeof(header), s->fp) != sizeof(header) ||
+       MZ_READ_LE32(header) != MZ_ZIP_LOCAL_DIR_HEADER_SIG)
+    {
+        return FS_ECANTREAD;
+    }
+    s->dataOfs = st.m_local_header_ofs + MZ_ZIP_LOCAL_DIR_HEADER_SIZE +
+        MZ_READ_LE16(header + MZ_ZIP_LDH_FILENAME_LEN_OFS) +
+        MZ_READ_LE16(header + MZ_ZIP_LDH_EXTRA_LEN_OFS);
+    s->method = st.m_method;
+    s->size = st.m_uncomp_size;
+    s->compSize = st.m_comp_size;
+    return initInflate(s);
+}
+
+static int openPackEntry(fs_Stream* s, PathNode* p, int idx)
+{
+    /* Pack payloads are raw deflate like zip's, so they stream the same way */
+    const PackEntry* e = &p->entries[idx];
+    if(!packPayload(p, idx))
+        return FS_ECANTREAD;
+    s->fp = fopen(p->path, "rb");
+    if(!s->fp)
+        return FS_ECANTOPEN;
+    s->dataOfs = e->offset;
+    s->method = (e->flags & PACK_FDEFLATE) ? MZ_DEFLATED : 0;
+    s->size = e->size;
+    s->compSize = e->compSize;
+    return initInflate(s);
+}
+
+fs_Stream* fs_openStream(const char* filename)
+{
+    if(checkFilename(filename) != FS_ESUCCESS)
+        return NULL;
+    filename = skipDotSlash(filename);
+    PathNode* p;
+    int idx;
+    if(resolveFile(filename, &p, &idx) != FS_ESUCCESS)
+        return NULL;
+    if(p->type == PATH_TDIR)
+    {
+        char* r = concat(p->path, "/", filename, NULL);
+        if(!r)
+            return NULL;
+        FILE* fp = isDir(r) ? NULL : fopen(r, "rb");
+        free(r);
+        if(!fp)
+            return NULL;
+        fs_Stream* s = calloc(1, sizeof(*s));
+        if(!s)
+        {
             fclose(fp);
-            return res;
+            return NULL;
         }
-        else if(p->type == PATH_TZIP)
+        s->type = PATH_TDIR;
+        s->fp = fp;
+        fseek(fp, 0, SEEK_END);
+        s->size = ftell(fp);
+        fseek(fp, 0, SEEK_SET);
+        return s;
+    }
+    fs_Stream* s = calloc(1, sizeof(*s));
+    if(!s)
+        return NULL;
+    s->type = p->type;
+    int err = (p->type == PATH_TPACK) ? openPackEntry(s, p, idx)
+        : mz_zip_reader_is_file_a_directory(&p->zip, idx) ? FS_ECANTOPEN
+        : openZipEntry(s, p, idx);
+    if(err != FS_ESUCCESS)
+    {
+        fs_closeStream(s);
+        return NULL;
+    }
+    return s;
+}
+
+static size_t inflateStream(fs_Stream* s, mz_uint8* dst, size_t len)
+{
+    size_t n = 0;
+    while(n < len)
+    {
+        /* Hand out bytes already inflated into the dictionary first */
+        if(s->dictAvail)
         {
-            char* res = mz_zip_reader_extract_file_to_heap(
-                &p->zip, filename, len, 0);
-            if(res)
-            {
-                return res;
-            }
+            size_t start = (s->dictOfs - s->dictAvail) & (TINFL_LZ_DICT_SIZE - 1);
+            size_t sz = MZ_MIN(s->dictAvail, len - n);
+            sz = MZ_MIN(sz, TINFL_LZ_DICT_SIZE - start);
+            memcpy(dst + n, s->dict + start, sz);
+            s->dictAvail -= sz;
+            n += sz;
+            continue;
         }
-    next:
-        p = p->next;
+        /* Refill input buffer */
+        if(!s->inAvail && s->compPos < s->compSize)
+        {
+            size_t sz = MZ_MIN(STREAM_INBUF_SIZE, s->compSize - s->compPos);
+            fseek(s->fp, s->dataOfs + s->compPos, SEEK_SET);
+            if(fread(s->inBuf, 1, sz, s->fp) != sz)
+                break;
+            s->compPos += sz;
+            s->inOfs = 0;
+            s->inAvail = sz;
+        }
+        /* Inflate into the circular dictionary */
+        size_t ofs = s->dictOfs & (TINFL_LZ_DICT_SIZE - 1);
+        size_t inSize = s->inAvail;
+        size_t outSize = TINFL_LZ_DICT_SIZE - ofs;
+        tinfl_status status = tinfl_decompress(
+            &s->inflator, s->inBuf + s->inOfs, &inSize, s->dict, s->dict + ofs,
+            &outSize, (s->compPos < s->compSize) ? TINFL_FLAG_HAS_MORE_INPUT : 0);
+        s->inOfs += inSize;
+        s->inAvail -= inSize;
+        s->dictOfs += outSize;
+        s->dictAvail = outSize;
+        if(status < TINFL_STATUS_DONE || (status == TINFL_STATUS_DONE && !outSize))
+            break;
     }
-    return NULL;
+    return n;
+}
+
+fs_Stream* fs_openWriteStream(const char* filename, int append)
+{
+    /* Opens a file in the write path, which stays open until closed */
+    if(!writePath || checkFilename(filename) != FS_ESUCCESS)
+        return NULL;
+    char* name = concat(writePath->path, "/", filename, NULL);
+    if(!name)
+        return NULL;
+    forgetWritten(filename);
+    FILE* fp = fopen(name, append ? "ab" : "wb");
+    free(name);
+    if(!fp)
+        return NULL;
+    fs_Stream* s = calloc(1, sizeof(*s));
+    if(!s)
+    {
+        fclose(fp);
+        return NULL;
+    }
+    setvbuf(fp, NULL, _IOFBF, STREAM_WRITEBUF_SIZE);
+    s->type = PATH_TDIR;
+    s->mode = append ? STREAM_APPEND : STREAM_WRITE;
+    s->fp = fp;
+    if(append)
+    {
+        fseek(fp, 0, SEEK_END);
+        s->size = s->pos = ftell(fp);
+    }
+    return s;
+}
+
+size_t fs_writeStream(fs_Stream* s, const void* src, size_t len)
+{
+    if(s->mode == STREAM_READ)
+        return 0;
+    size_t n = fwrite(src, 1, len, s->fp);
+    /* Appends always land at the end, wherever we've seeked to */
+    if(s->mode == STREAM_APPEND)
+    {
+        s->pos = s->size;
+    }
+    s->pos += n;
+    s->size = MZ_MAX(s->size, s->pos);
+    return n;
+}
+
+int fs_flushStream(fs_Stream* s)
+{
+    if(s->mode != STREAM_READ && fflush(s->fp) != 0)
+        return FS_ECANTWRITE;
+    return FS_ESUCCESS;
+}
+
+size_t fs_readStream(fs_Stream* s, void* dst, size_t len)
+{
+    size_t n;
+    if(s->mode != STREAM_READ)
+        return 0;
+    len = MZ_MIN(len, s->size - s->pos);
+    if(s->type == PATH_TDIR)
+    {
+        n = fread(dst, 1, len, s->fp);
+    }
+    else if(s->method == MZ_DEFLATED)
+    {
+        n = inflateStream(s, dst, len);
+    }
+    else
+    {
+        fseek(s->fp, s->dataOfs + s->pos, SEEK_SET);
+        n = fread(dst, 1, len, s->fp);
+    }
+    s->pos += n;
+    return n;
+}
+
+int fs_seekStream(fs_Stream* s, size_t pos)
+{
+    if(pos > s->size)
+        return FS_EFAILURE;
+    if(s->type == PATH_TDIR)
+    {
+        if(fseek(s->fp, pos, SEEK_SET) != 0)
+            return FS_ECANTREAD;
+    }
+    else if(s->method == MZ_DEFLATED)
+    {
+        /* Deflate streams can only go forward: restart the inflator when seeking
+         * backwards and discard bytes until we reach the position */
+        if(pos < s->pos)
+        {
+            tinfl_init(&s->inflator);
+            s->compPos = s->inOfs = s->inAvail = 0;
+            s->dictOfs = s->dictAvail = 0;
+            s->pos = 0;
+        }
+        char buf[512];
+        while(s->pos < pos)
+        {
+            if(!fs_readStream(s, buf, MZ_MIN(sizeof(buf), pos - s->pos)))
+                return FS_ECANTREAD;
+        }
+    }
+    s->pos = pos;
+    return FS_ESUCCESS;
+}
+
+size_t fs_tellStream(fs_Stream* s)
+{
+    return s->pos;
+}
+
+size_t fs_streamSize(fs_Stream* s)
+{
+    return s->size;
+}
+
+void fs_closeStream(fs_Stream* s)
+{
+    if(s->fp)
+    {
+        fclose(s->fp);
+    }
+    free(s->inBuf);
+    free(s->dict);
+    free(s);
 }
 
 int fs_isDir(const char* filename)
@@ -543,6 +1683,30 @@ fs_FileListNode* fs_listDir(const char* path)
                 }
             }
         }
+        else if(p->type == PATH_TPACK)
+        {
+            /* Names carry no trailing separator, directories are flagged */
+            uint32_t i;
+            for(i = 0; i < p->count; i++)
+            {
+                const char* filename = packName(p, &p->entries[i]);
+                if(pathTrimmedLen != 0)
+                {
+                    if(strncmp(filename, pathTrimmed, pathTrimmedLen) != 0 ||
+                       !isSeparator(filename[pathTrimmedLen]))
+                    {
+                        continue;
+                    }
+                    filename += pathTrimmedLen + 1;
+                }
+                if(*filename == '\0' || containsSeparator(filename))
+                    continue;
+                if(appendFileListNode(&res, filename) != FS_ESUCCESS)
+                {
+                    goto outOfMem;
+                }
+            }
+        }
     next:
         p = p->next;
     }
@@ -575,6 +1739,7 @@ static int writeUsingMode(
     char* name = concat(writePath->path, "/", filename, NULL);
     if(!name)
         return FS_EOUTOFMEM;
+    forgetWritten(filename);
     FILE* fp = fopen(name, mode);
     free(name);
     if(!fp)
@@ -603,6 +1768,7 @@ int fs_delete(const char* filename)
     char* name = concat(writePath->path, "/", filename, NULL);
     if(!name)
         return FS_EOUTOFMEM;
+    forgetWritten(filename);
     int res = remove(name);
     free(name);
     return (res == 0) ? FS_ESUCCESS : FS_ECANTDELETE;
@@ -617,6 +1783,7 @@ int fs_makeDirs(const char* path)
     char* name = concat(writePath->path, "/", path, NULL);
     if(!name)
         return FS_EOUTOFMEM;
+    forgetWritten(path);
     int res = makeDirs(name);
     free(name);
     return res;
@@ -14,6 +14,21 @@ typedef struct fs_FileListNode
     struct fs_FileListNode* next;
 } fs_FileListNode;
 
+typedef struct fs_Stream fs_Stream;
+
+typedef struct fs_Region fs_Region;
+
+typedef struct fs_Read fs_Read;
+
+/* A file's contents, either mapped into memory or read onto the heap
+ * (`region` is NULL); mapped contents are read-only */
+typedef struct
+{
+    void* data;
+    size_t size;
+    fs_Region* region;
+} fs_Map;
+
 enum 
 {
     FS_ESUCCESS     = 0,
@@ -39,6 +54,20 @@ int fs_exists(const char* filename);
 int fs_modified(const char* filename, unsigned* mtime);
 int fs_size(const char* filename, size_t* size);
 void* fs_read(const char* filename, size_t* size);
+int fs_map(const char* filename, fs_Map* map);
+void fs_unmap(fs_Map* map);
+int fs_openRead(const char* filename, fs_Read** read);
+int fs_performRead(fs_Read* read, fs_Map* map);
+void fs_closeRead(fs_Read* read);
+fs_Stream* fs_openStream(const char* filename);
+fs_Stream* fs_openWriteStream(const char* filename, int append);
+size_t fs_readStream(fs_Stream* stream, void* dst, size_t len);
+size_t fs_writeStream(fs_Stream* stream, const void* src, size_t len);
+int fs_flushStream(fs_Stream* stream);
+int fs_seekStream(fs_Stream* stream, size_t pos);
+size_t fs_tellStream(fs_Stream* stream);
+size_t fs_streamSize(fs_Stream* stream);
+void fs_closeStream(fs_Stream* stream);
 int fs_isDir(const char* filename);
 fs_FileListNode* fs_listDir(const char* path);
 void fs_freeFileList(fs_FileListNode* list);
@@ -167,10 +167,21 @@ int main(int argc, char** argv)
         { NULL, NULL, 0 }
     };
 
+    /* Time spent loading (not running) the scripts -- they're embedded as
+     * bytecode unless this is a debug build. Set JUNO_TRACE_STARTUP to see it */
+    double freq = SDL_GetPerformanceFrequency();
+    Uint64 loadTicks = 0;
     int i;
     for(i = 0; items[i].name; i++)
     {
+        Uint64 start = SDL_GetPerformanceCounter();
         int err = luaL_loadbuffer(L, items[i].data, items[i].size, items[i].name);
+        loadTicks += SDL_GetPerformanceCounter() - start;
+        if(!err && getenv("JUNO_TRACE_STARTUP") && !items[i + 1].name)
+        {
+            fprintf(stderr, "startup: loaded embedded scripts in %.3fms\n",
+                loadTicks * 1000 / freq);
+        }
         if(err || lua_pcall(L, 0, 0, 0) != 0)
         {
             const char* str = lua_tostring(L, -1);
@@ -247,9 +258,10 @@ int main(int argc, char** argv)
 
     sr_destroyBuffer(screen);
 
+    /* Stop the audio callback before the lua state it uses goes away */
+    audio_close();
     lua_close(L);
 
-    SDL_CloseAudio();
     SDL_Quit();
 
     return EXIT_SUCCESS;
@@ -1,34 +1,207 @@
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
+#include <math.h>
 
 #include <SDL.h>
 
 #include "common.h"
 #include "luax.h"
+#include "fs.h"
 #include "m_source.h"
 
+#define RENDER_BLOCK 65536
+
+/* The float mixer passes everything below the knee (about -2dB) untouched and
+ * bends what's above it smoothly towards full scale instead of clipping */
+#define SOFTCLIP_KNEE 0.8f
+
 static bool inited = 0;
 static double samplerate = 0;
+static int channels = 0;
+static SDL_AudioDeviceID device = 0;
+static bool outputFloat = 0;
+
+/* Written by the audio thread only, read from Lua at any time: each field is
+ * atomic on its own, so a read may mix values from consecutive callbacks.
+ * Times are in microseconds */
+static struct
+{
+    SDL_atomic_t callbacks;
+    SDL_atomic_t time;
+    SDL_atomic_t maxTime;
+    SDL_atomic_t mixTime;
+    SDL_atomic_t decodeTime;
+    SDL_atomic_t budget;
+    SDL_atomic_t voices;
+    SDL_atomic_t late;
+    SDL_atomic_t overruns;
+} stats;
+static Uint64 lastCallback;
+
+static float soft_clip(float x)
+{
+    float a = fabsf(x);
+    if(a <= SOFTCLIP_KNEE)
+    {
+        return x;
+    }
+    a = SOFTCLIP_KNEE + (1 - SOFTCLIP_KNEE) * tanhf((a - SOFTCLIP_KNEE) / (1 - SOFTCLIP_KNEE));
+    return x < 0 ? -a : a;
+}
+
+static void write_output(Source* master, void* buffer, int frames, int nchannels, bool f32)
+{
+    /* Converts the master's buffer to the output format; mono output gets the
+     * average of both channels */
+    int len = frames * nchannels;
+    if(source_getFloatMixing())
+    {
+        const float* src = (const float*)master->buf;
+        for(int i = 0; i < len; i++)
+        {
+            float x = (nchannels == 2) ? src[i] : (src[i * 2] + src[i * 2 + 1]) * 0.5f;
+            x = soft_clip(x * (1.0f / 32768));
+            if(f32)
+            {
+                ((float*)buffer)[i] = x;
+            }
+            else
+            {
+                ((int16_t*)buffer)[i] = x * 32767 + (x < 0 ? -0.5f : 0.5f);
+            }
+        }
+    }
+    else
+    {
+        const int* src = master->buf;
+        for(int i = 0; i < len; i++)
+        {
+            int x = (nchannels == 2) ? src[i] : (src[i * 2] + src[i * 2 + 1]) / 2;
+            x = CLAMP(x, -32768, 32767);
+            if(f32)
+            {
+                ((float*)buffer)[i] = x * (1.0f / 32768);
+            }
+            else
+            {
+                ((int16_t*)buffer)[i] = x;
+            }
+        }
+    }
+}
+
+static void mix(void* buffer, int frames, int nchannels, bool f32)
+{
+    /* Process sources audio in blocks no larger than the Source buffers, so any
+     * device buffer size works */
+    Source* master = source_getMaster(NULL);
+    int block = source_getBufferSize();
+    int sampleSize = f32 ? sizeof(float) : sizeof(int16_t);
+    char* p = buffer;
+    while(frames > 0)
+    {
+        int n = MIN(frames, block);
+        source_processAllSources(n * 2);
+
+        /* Out of memory for the master's buffer? Output silence */
+        if(!master->buf)
+        {
+            memset(p, 0, n * nchannels * sampleSize);
+        }
+        else
+        {
+            write_output(master, p, n, nchannels, f32);
+        }
+        p += n * nchannels * sampleSize;
+        frames -= n;
+    }
+}
 
 static void audio_callback(void* udata, Uint8* stream, int size)
 {
     lua_State* L = (lua_State*)udata;
-    int16_t* buffer = (int16_t*)stream;
-    int len = size / sizeof(int16_t);
+    int sampleSize = outputFloat ? sizeof(float) : sizeof(int16_t);
+    int frames = size / (sampleSize * channels);
+    double freq = SDL_GetPerformanceFrequency();
+    Uint64 start = SDL_GetPerformanceCounter();
+    double decode = source_getDecodeTime();
 
     /* Process source commands */
     source_processCommands(L);
 
     /* Process sources audio */
-    source_processAllSources(len);
+    mix(stream, frames, channels, outputFloat);
 
-    /* Copy master to buffer */
-    Source* master = source_getMaster(NULL);
-    for(int i = 0; i < len; i++)
+    /* Update stats */
+    int budget = frames * 1e6 / samplerate;
+    int time = (SDL_GetPerformanceCounter() - start) * 1e6 / freq;
+    int decodeTime = (source_getDecodeTime() - decode) * 1e6;
+    SDL_AtomicAdd(&stats.callbacks, 1);
+    SDL_AtomicSet(&stats.time, time);
+    SDL_AtomicSet(&stats.decodeTime, decodeTime);
+    SDL_AtomicSet(&stats.mixTime, time - decodeTime);
+    SDL_AtomicSet(&stats.budget, budget);
+    SDL_AtomicSet(&stats.voices, source_getActiveVoices());
+    int max = SDL_AtomicGet(&stats.maxTime);
+    while(time > max && !SDL_AtomicCAS(&stats.maxTime, max, time))
+    {
+        max = SDL_AtomicGet(&stats.maxTime);
+    }
+    /* Took longer than the audio it produced? The device will run dry */
+    if(time > budget)
     {
-        int x = master->buf[i];
-        buffer[i] = CLAMP(x, -32768, 32767);
+        SDL_AtomicAdd(&stats.overruns, 1);
     }
+    /* Called well after the previous buffer should have run out? */
+    if(lastCallback && (start - lastCallback) * 1e6 / freq > budget * 1.5)
+    {
+        SDL_AtomicAdd(&stats.late, 1);
+    }
+    lastCallback = start;
+}
+
+static int get_option(lua_State* L, int idx, const char* key, int def)
+{
+    if(!lua_istable(L, idx))
+        return def;
+    lua_getfield(L, idx, key);
+    if(!lua_isnil(L, -1) && !lua_isnumber(L, -1))
+    {
+        luaL_error(L, "expected number for audio option '%s'", key);
+    }
+    int res = lua_isnil(L, -1) ? def : (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+    return res;
+}
+
+static int get_enum_option(lua_State* L, int idx, const char* key,
+    const char* const opts[])
+{
+    /* Returns the index of the option's value in `opts`; the first is the
+     * default */
+    if(!lua_istable(L, idx))
+        return 0;
+    lua_getfield(L, idx, key);
+    const char* value = lua_tostring(L, -1);
+    int res = -1;
+    if(lua_isnil(L, -1))
+    {
+        res = 0;
+    }
+    for(int i = 0; value && opts[i]; i++)
+    {
+        if(strcmp(opts[i], value) == 0)
+        {
+            res = i;
+        }
+    }
+    if(res < 0)
+    {
+        luaL_error(L, "bad value for audio option '%s'", key);
+    }
+    lua_pop(L, 1);
+    return res;
 }
 
 static int l_audio_init(lua_State* L)
@@ -38,38 +211,218 @@ static int l_audio_init(lua_State* L)
         luaL_error(L, "audio is already inited");
     }
 
+    int rate = get_option(L, 1, "rate", 44100);
+    int bufferSize = get_option(L, 1, "bufferSize", 2048);
+    int nchannels = get_option(L, 1, "channels", 2);
+    /* The float mixer costs more per voice, but doesn't lose quiet sources to
+     * fixed-point rounding and soft-clips instead of hard-clipping */
+    static const char* const mixers[] = { "fixed", "float", NULL };
+    static const char* const formats[] = { "int16", "float32", NULL };
+    int mixer = get_enum_option(L, 1, "mixer", mixers);
+    int format = get_enum_option(L, 1, "format", formats);
+    if(rate <= 0)
+    {
+        luaL_argerror(L, 1, "expected rate greater than 0");
+    }
+    if(bufferSize <= 0 || (bufferSize & (bufferSize - 1)) || bufferSize > 65536)
+    {
+        luaL_argerror(L, 1, "expected bufferSize to be a power of 2");
+    }
+    if(nchannels != 1 && nchannels != 2)
+    {
+        luaL_argerror(L, 1, "expected 1 or 2 channels");
+    }
+
     if(SDL_Init(SDL_INIT_AUDIO) != 0)
     {
         luaL_error(L, "could not init audio");
     }
 
     /* Init format, open and start */
-    SDL_AudioSpec fmt;
+    SDL_AudioSpec fmt, got;
     memset(&fmt, 0, sizeof(fmt));
-    fmt.freq = 44100;
-    fmt.format = AUDIO_S16SYS;
-    fmt.channels = 2;
+    fmt.freq = rate;
+    fmt.format = format ? AUDIO_F32SYS : AUDIO_S16SYS;
+    fmt.channels = nchannels;
     fmt.callback = audio_callback;
-    fmt.samples = 2048;
+    fmt.samples = bufferSize;
     fmt.userdata = L;
 
-    if(SDL_OpenAudio(&fmt, NULL) != 0)
+    /* Let the device pick its own rate and buffer size if it can't do ours --
+     * the mixer follows whatever we actually get */
+    device = SDL_OpenAudioDevice(NULL, 0, &fmt, &got,
+        SDL_AUDIO_ALLOW_FREQUENCY_CHANGE | SDL_AUDIO_ALLOW_SAMPLES_CHANGE);
+    if(device == 0)
     {
         luaL_error(L, "could not open audio: %s", SDL_GetError());
     }
 
-    samplerate = 44100;
+    samplerate = got.freq;
+    channels = got.channels;
+    outputFloat = format;
     inited = true;
+    source_setFloatMixing(mixer);
     source_setSamplerate(samplerate);
+    source_setBufferSize(got.samples);
+    /* Commands wait for the callback from now on */
+    source_setDirect(NULL);
+
+    /* Start decoding streams in the background */
+    source_startDecoder();
 
     /* Start audio */
-    SDL_PauseAudio(0);
+    SDL_PauseAudioDevice(device, 0);
 
     return 0;
 }
 
+static int l_audio_getSamplerate(lua_State* L)
+{
+    lua_pushnumber(L, samplerate);
+    return 1;
+}
+
+static int l_audio_getTime(lua_State* L)
+{
+    /* Seconds of audio mixed so far -- the clock `Source:play{at=}` uses */
+    lua_pushnumber(L, source_getTime());
+    return 1;
+}
+
+static void write_u32(unsigned char* p, unsigned x)
+{
+    p[0] = x;
+    p[1] = x >> 8;
+    p[2] = x >> 16;
+    p[3] = x >> 24;
+}
+
+static void write_wav_header(unsigned char* p, int samplerate, unsigned size)
+{
+    /* 16bit stereo PCM */
+    memcpy(p, "RIFF", 4);
+    write_u32(p + 4, 36 + size);
+    memcpy(p + 8, "WAVEfmt ", 8);
+    write_u32(p + 16, 16);
+    write_u32(p + 20, 1 | (2 << 16));
+    write_u32(p + 24, samplerate);
+    write_u32(p + 28, samplerate * 4);
+    write_u32(p + 32, 4 | (16 << 16));
+    memcpy(p + 36, "data", 4);
+    write_u32(p + 40, size);
+}
+
+static int l_audio_renderOffline(lua_State* L)
+{
+    double seconds = luaL_checknumber(L, 1);
+    const char* filename = luaL_optstring(L, 2, NULL);
+    int sr = source_getSamplerate();
+    double frames = seconds * sr;
+    if(frames < 0 || frames * 4 > 0xffffffffu - 36)
+    {
+        luaL_argerror(L, 1, "duration out of range");
+    }
+    int total = frames;
+    int16_t* buffer = malloc(RENDER_BLOCK * 2 * sizeof(int16_t));
+    if(!buffer)
+    {
+        luaL_error(L, "out of memory");
+    }
+
+    /* Keep the device and the decoder thread off the mixer for the duration,
+     * streams are decoded inline so the result is deterministic */
+    if(inited)
+    {
+        SDL_LockAudioDevice(device);
+    }
+    source_stopDecoder();
+
+    int res = FS_ESUCCESS;
+    if(filename)
+    {
+        unsigned char header[44];
+        write_wav_header(header, sr, total * 4);
+        res = fs_write(filename, header, sizeof(header));
+    }
+
+    /* Apply everything queued so far, then mix as fast as we can */
+    source_processCommands(L);
+    double mixTime = 0;
+    double freq = SDL_GetPerformanceFrequency();
+    int done = 0;
+    while(done < total && res == FS_ESUCCESS)
+    {
+        int n = MIN(total - done, RENDER_BLOCK);
+        Uint64 start = SDL_GetPerformanceCounter();
+        mix(buffer, n, 2, false);
+        mixTime += (SDL_GetPerformanceCounter() - start) / freq;
+        if(filename)
+        {
+            res = fs_append(filename, buffer, n * 2 * sizeof(int16_t));
+        }
+        done += n;
+    }
+
+    free(buffer);
+    if(inited)
+    {
+        source_startDecoder();
+        SDL_UnlockAudioDevice(device);
+    }
+    if(res != FS_ESUCCESS)
+    {
+        luaL_error(L, "%s '%s'", fs_errorStr(res), filename);
+    }
+
+    /* Return the time spent mixing */
+    lua_pushnumber(L, mixTime);
+    return 1;
+}
+
+static int l_audio_setListener(lua_State* L)
+{
+    double x = luaL_checknumber(L, 1);
+    double y = luaL_checknumber(L, 2);
+    source_setListener(x, y);
+    return 0;
+}
+
+static int l_audio_getStats(lua_State* L)
+{
+    lua_newtable(L);
+    luax_setfield_number(L, "callbacks", SDL_AtomicGet(&stats.callbacks));
+    luax_setfield_number(L, "time", SDL_AtomicGet(&stats.time) / 1e6);
+    /* The peak is reset on every read */
+    luax_setfield_number(L, "maxTime", SDL_AtomicSet(&stats.maxTime, 0) / 1e6);
+    luax_setfield_number(L, "mixTime", SDL_AtomicGet(&stats.mixTime) / 1e6);
+    luax_setfield_number(L, "decodeTime", SDL_AtomicGet(&stats.decodeTime) / 1e6);
+    luax_setfield_number(L, "budget", SDL_AtomicGet(&stats.budget) / 1e6);
+    luax_setfield_number(L, "voices", SDL_AtomicGet(&stats.voices));
+    luax_setfield_number(L, "late", SDL_AtomicGet(&stats.late));
+    luax_setfield_number(L, "overruns", SDL_AtomicGet(&stats.overruns));
+    luax_setfield_number(L, "underruns", source_getUnderruns());
+    return 1;
+}
+
+void audio_close(void)
+{
+    if(!inited)
+        return;
+    /* Closing waits for the callback to finish, after which nothing else uses
+     * the decoder */
+    SDL_CloseAudioDevice(device);
+    source_stopDecoder();
+    device = 0;
+    inited = false;
+}
+
 static const luaL_Reg reg[] = {
     { "init", l_audio_init },
+    { "getSamplerate", l_audio_getSamplerate },
+    { "getTime", l_audio_getTime },
+    { "getStats", l_audio_getStats },
+    { "setListener", l_audio_setListener },
+    { "renderOffline", l_audio_renderOffline },
     { NULL, NULL }
 };
 
@@ -77,10 +430,14 @@ int luaopen_audio(lua_State* L)
 {
     luaL_newlib(L, reg);
 
+    /* Until audio is inited nothing mixes, so Source commands are applied as
+     * they're made */
+    source_setDirect(L);
+
     /* Add .master Source field */
     int ref;
     source_getMaster(&ref);
     lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
     lua_setfield(L, -2, "master");
     return 1;
-}
\ No newline at end of file
+}
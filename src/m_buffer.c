@@ -63,14 +63,13 @@ static int l_buffer_fromFile(lua_State* L)
 {
     const char* filename = luaL_checkstring(L, 1);
     Buffer* self = buffer_new(L);
-    size_t len;
-    void* data = fs_read(filename, &len);
-    if(!data)
+    fs_Map map;
+    if(fs_map(filename, &map) != FS_ESUCCESS)
     {
         luaL_error(L, "could not open file '%s'", filename);
     }
-    int err = load_buffer(self, data, len);
-    free(data);
+    int err = load_buffer(self, map.data, map.size);
+    fs_unmap(&map);
     if(err)
     {
         luaL_error(L, "could not load buffer");
@@ -17,7 +17,14 @@ static Data* new_data(lua_State* L)
 static int l_data_gc(lua_State* L)
 {
     Data* self = (Data*)luaL_checkudata(L, 1, CLASS_NAME);
-    free(self->data);
+    if(self->map.data)
+    {
+        fs_unmap(&self->map);
+    }
+    else
+    {
+        free(self->data);
+    }
     return 1;
 }
 
@@ -25,14 +32,12 @@ static int l_data_fromFile(lua_State* L)
 {
     const char* filename = luaL_checkstring(L, 1);
     Data* self = new_data(L);
-    size_t len;
-    void* data = fs_read(filename, &len);
-    if(!data)
+    if(fs_map(filename, &self->map) != FS_ESUCCESS)
     {
         luaL_error(L, "could not open file '%s'", filename);
     }
-    self->data = data;
-    self->len = len;
+    self->data = self->map.data;
+    self->len = self->map.size;
     return 1;
 }
 
@@ -1,12 +1,16 @@
 #ifndef M_DATA_H
 #define M_DATA_H
 
+#include "fs.h"
+
 #define DATA_CLASS_NAME "Data"
 
 typedef struct
 {
     void* data;
-    int len;
+    size_t len;
+    /* Set for Data loaded from a file, which may be a read-only mapping */
+    fs_Map map;
 } Data;
 
 #endif
\ No newline at end of file
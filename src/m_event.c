@@ -5,6 +5,8 @@
 #include "luax.h"
 #include "mapping.h"
 #include "fs.h"
+#include "m_filesystem.h"
+#include "m_source.h"
 
 static int l_event_poll(lua_State* L)
 {
@@ -198,6 +200,11 @@ static int l_event_poll(lua_State* L)
                 luax_setfield_string(L, "type", "quit");
                 break;
             default:
+                /* Completed async reads; the type is only known at runtime */
+                if(e.type == filesystem_readEvent)
+                {
+                    filesystem_pushReadEvent(L, e.user.data1);
+                }
                 break;
         }
 
@@ -210,6 +217,8 @@ static int l_event_poll(lua_State* L)
 static int l_event_pump(lua_State* L)
 {
     SDL_PumpEvents();
+    /* Runs once a frame, a good time for the mixer's Lua-side upkeep */
+    source_update();
     return 0;
 }
 
@@ -0,0 +1,279 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "luax.h"
+#include "fs.h"
+
+#define CLASS_NAME "File"
+#define BUFFER_SIZE 4096
+
+/* A file kept open across calls. Reads come from any mount (zip and pack
+ * entries are inflated as they're read) through a small buffer so lines can be
+ * read without loading the whole file; writes go to the write path and are
+ * buffered until full, flushed or closed */
+typedef struct
+{
+    fs_Stream* stream;
+    int writing;
+    size_t bufPos, bufLen;
+    char buf[BUFFER_SIZE];
+} File;
+
+static File* check_file(lua_State* L, int idx)
+{
+    File* self = luaL_checkudata(L, idx, CLASS_NAME);
+    if(!self->stream)
+    {
+        luaL_error(L, "attempt to use a closed file");
+    }
+    return self;
+}
+
+static void check_mode(lua_State* L, File* self, int writing)
+{
+    if(self->writing != writing)
+    {
+        luaL_error(L, "file not opened for %s", writing ? "writing" : "reading");
+    }
+}
+
+static size_t fill_buffer(File* self)
+{
+    if(self->bufPos == self->bufLen)
+    {
+        self->bufLen = fs_readStream(self->stream, self->buf, BUFFER_SIZE);
+        self->bufPos = 0;
+    }
+    return self->bufLen - self->bufPos;
+}
+
+static int read_bytes(lua_State* L, File* self, size_t n)
+{
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    size_t total = 0;
+    while(total < n && fill_buffer(self))
+    {
+        size_t sz = self->bufLen - self->bufPos;
+        if(sz > n - total)
+            sz = n - total;
+        luaL_addlstring(&b, self->buf + self->bufPos, sz);
+        self->bufPos += sz;
+        total += sz;
+    }
+    luaL_pushresult(&b);
+    /* Nothing left to read -- but reading 0 bytes isn't the end of the file */
+    return total > 0 || n == 0;
+}
+
+static int read_line(lua_State* L, File* self, int keepNewline)
+{
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    int found = 0;
+    int any = 0;
+    while(!found && fill_buffer(self))
+    {
+        char* p = self->buf + self->bufPos;
+        size_t sz = self->bufLen - self->bufPos;
+        char* nl = memchr(p, '\n', sz);
+        if(nl)
+        {
+            sz = nl - p + 1;
+            found = 1;
+        }
+        self->bufPos += sz;
+        any = 1;
+        luaL_addlstring(&b, p, (found && !keepNewline) ? sz - 1 : sz);
+    }
+    luaL_pushresult(&b);
+    return any;
+}
+
+static int l_file_open(lua_State* L)
+{
+    const char* filename = luaL_checkstring(L, 1);
+    const char* mode = luaL_optstring(L, 2, "r");
+    File* self = lua_newuserdata(L, sizeof(*self));
+    luaL_setmetatable(L, CLASS_NAME);
+    memset(self, 0, sizeof(*self));
+    switch(*mode)
+    {
+        case 'r':
+            self->stream = fs_openStream(filename);
+            break;
+        case 'w':
+        case 'a':
+            self->writing = 1;
+            self->stream = fs_openWriteStream(filename, *mode == 'a');
+            break;
+        default:
+            luaL_argerror(L, 2, "expected \"r\", \"w\" or \"a\"");
+    }
+    if(!self->stream)
+    {
+        luaL_error(L, "could not open file '%s'", filename);
+    }
+    return 1;
+}
+
+static int l_file_gc(lua_State* L)
+{
+    File* self = luaL_checkudata(L, 1, CLASS_NAME);
+    if(self->stream)
+    {
+        fs_closeStream(self->stream);
+    }
+    return 0;
+}
+
+static int l_file_read(lua_State* L)
+{
+    /* Takes a byte count or, as with Lua's files, "*l" for a line, "*L" for a
+     * line with its newline or "*a" for the rest of the file; returns nil at
+     * the end of the file */
+    File* self = check_file(L, 1);
+    check_mode(L, self, 0);
+    int ok;
+    if(lua_type(L, 2) == LUA_TNUMBER)
+    {
+        lua_Number n = lua_tonumber(L, 2);
+        ok = read_bytes(L, self, n > 0 ? (size_t)n : 0);
+    }
+    else
+    {
+        const char* fmt = luaL_optstring(L, 2, "*l");
+        if(*fmt == '*')
+            fmt++;
+        switch(*fmt)
+        {
+            case 'l':
+            case 'L':
+                ok = read_line(L, self, *fmt == 'L');
+                break;
+            case 'a':
+                read_bytes(L, self, (size_t)-1);
+                ok = 1;
+                break;
+            default:
+                return luaL_argerror(L, 2, "invalid format");
+        }
+    }
+    if(!ok)
+    {
+        lua_pop(L, 1);
+        lua_pushnil(L);
+    }
+    return 1;
+}
+
+static int lines_iter(lua_State* L)
+{
+    File* self = luaL_checkudata(L, lua_upvalueindex(1), CLASS_NAME);
+    if(!self->stream || !read_line(L, self, 0))
+    {
+        return 0;
+    }
+    return 1;
+}
+
+static int l_file_lines(lua_State* L)
+{
+    File* self = check_file(L, 1);
+    check_mode(L, self, 0);
+    lua_settop(L, 1);
+    lua_pushcclosure(L, lines_iter, 1);
+    return 1;
+}
+
+static int l_file_write(lua_State* L)
+{
+    File* self = check_file(L, 1);
+    check_mode(L, self, 1);
+    int n = lua_gettop(L);
+    for(int i = 2; i <= n; i++)
+    {
+        size_t len;
+        const char* str = luaL_checklstring(L, i, &len);
+        if(fs_writeStream(self->stream, str, len) != len)
+        {
+            luaL_error(L, "could not write to file");
+        }
+    }
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int l_file_flush(lua_State* L)
+{
+    File* self = check_file(L, 1);
+    if(fs_flushStream(self->stream) != FS_ESUCCESS)
+    {
+        luaL_error(L, "could not write to file");
+    }
+    return 0;
+}
+
+static int l_file_seek(lua_State* L)
+{
+    /* Moves to `pos` if given; returns the position either way */
+    File* self = check_file(L, 1);
+    if(!lua_isnoneornil(L, 2))
+    {
+        lua_Number pos = luaL_checknumber(L, 2);
+        if(pos < 0 || fs_seekStream(self->stream, pos) != FS_ESUCCESS)
+        {
+            luaL_error(L, "could not seek to %f", pos);
+        }
+        self->bufPos = self->bufLen = 0;
+    }
+    size_t pos = fs_tellStream(self->stream) - (self->bufLen - self->bufPos);
+    lua_pushnumber(L, pos);
+    return 1;
+}
+
+static int l_file_getSize(lua_State* L)
+{
+    File* self = check_file(L, 1);
+    lua_pushnumber(L, fs_streamSize(self->stream));
+    return 1;
+}
+
+static int l_file_close(lua_State* L)
+{
+    File* self = luaL_checkudata(L, 1, CLASS_NAME);
+    int err = FS_ESUCCESS;
+    if(self->stream)
+    {
+        err = fs_flushStream(self->stream);
+        fs_closeStream(self->stream);
+        self->stream = NULL;
+    }
+    if(err != FS_ESUCCESS)
+    {
+        luaL_error(L, "could not write to file");
+    }
+    return 0;
+}
+
+static const luaL_Reg reg[] = {
+    { "__gc", l_file_gc },
+    { "open", l_file_open },
+    { "read", l_file_read },
+    { "lines", l_file_lines },
+    { "write", l_file_write },
+    { "flush", l_file_flush },
+    { "seek", l_file_seek },
+    { "getSize", l_file_getSize },
+    { "close", l_file_close },
+    { NULL, NULL }
+};
+
+int luaopen_file(lua_State* L)
+{
+    luaL_newmetatable(L, CLASS_NAME);
+    luaL_setfuncs(L, reg, 0);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    return 1;
+}
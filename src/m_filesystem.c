@@ -1,8 +1,37 @@
 #include <stdlib.h>
+#include <string.h>
+
+#include <SDL.h>
 
 #include "luax.h"
 
 #include "fs.h"
+#include "m_data.h"
+#include "m_filesystem.h"
+
+/* Async reads -- jobs are queued for a small pool of I/O threads, each of
+ * which pushes a `filesystem_readEvent` when its job is done. juno.event.poll
+ * hands the event back to us to turn into a "fileread" event table */
+#define READ_THREADS 2
+
+typedef struct ReadJob
+{
+    struct ReadJob* next;
+    int id;
+    fs_Read* read;
+    fs_Map map;
+    int err;
+    char filename[1];
+} ReadJob;
+
+Uint32 filesystem_readEvent = (Uint32)-1;
+static SDL_Thread* readThreads[READ_THREADS];
+static SDL_sem* readSem;
+static SDL_mutex* readLock;
+static SDL_atomic_t readQuit;
+static ReadJob* readQueue;
+static ReadJob** readQueueTail = &readQueue;
+static int readId;
 
 static void check_error(lua_State* L, int err, const char* str)
 {
@@ -15,6 +44,115 @@ static void check_error(lua_State* L, int err, const char* str)
     luaL_error(L, "%s '%s'", fs_errorStr(err), str);
 }
 
+static void free_job(ReadJob* job)
+{
+    if(!job->err)
+    {
+        fs_unmap(&job->map);
+    }
+    fs_closeRead(job->read);
+    free(job);
+}
+
+static int read_thread(void* udata)
+{
+    (void)udata;
+    for(;;)
+    {
+        SDL_SemWait(readSem);
+        if(SDL_AtomicGet(&readQuit))
+            break;
+        SDL_LockMutex(readLock);
+        ReadJob* job = readQueue;
+        readQueue = job->next;
+        if(!readQueue)
+        {
+            readQueueTail = &readQueue;
+        }
+        SDL_UnlockMutex(readLock);
+        job->err = fs_performRead(job->read, &job->map);
+        SDL_Event e;
+        memset(&e, 0, sizeof(e));
+        e.type = filesystem_readEvent;
+        e.user.data1 = job;
+        /* The event queue only refuses events while it's full -- wait for it
+         * to be drained rather than lose the job and its reference on the
+         * mapping. Once quitting the main thread is waiting on us, so the job
+         * can be freed here */
+        while(SDL_PushEvent(&e) <= 0)
+        {
+            if(SDL_AtomicGet(&readQuit))
+            {
+                free_job(job);
+                break;
+            }
+            SDL_Delay(1);
+        }
+    }
+    return 0;
+}
+
+static void stop_readers(void)
+{
+    SDL_AtomicSet(&readQuit, 1);
+    for(int i = 0; i < READ_THREADS; i++)
+    {
+        SDL_SemPost(readSem);
+    }
+    for(int i = 0; i < READ_THREADS; i++)
+    {
+        SDL_WaitThread(readThreads[i], NULL);
+    }
+}
+
+static int start_readers(void)
+{
+    /* Started on first use; any threads that could be created do the work */
+    if(!readSem)
+    {
+        filesystem_readEvent = SDL_RegisterEvents(1);
+        if(filesystem_readEvent == (Uint32)-1)
+            return 0;
+        readSem = SDL_CreateSemaphore(0);
+        readLock = SDL_CreateMutex();
+        for(int i = 0; i < READ_THREADS; i++)
+        {
+            readThreads[i] = SDL_CreateThread(read_thread, "juno io", NULL);
+        }
+        atexit(stop_readers);
+    }
+    for(int i = 0; i < READ_THREADS; i++)
+    {
+        if(readThreads[i])
+            return 1;
+    }
+    return 0;
+}
+
+void filesystem_pushReadEvent(lua_State* L, void* udata)
+{
+    ReadJob* job = udata;
+    luax_setfield_string(L, "type", "fileread");
+    luax_setfield_number(L, "id", job->id);
+    luax_setfield_string(L, "filename", job->filename);
+    if(job->err)
+    {
+        luax_setfield_string(L, "error", fs_errorStr(job->err));
+    }
+    else
+    {
+        Data* data = (Data*)lua_newuserdata(L, sizeof(*data));
+        luaL_setmetatable(L, DATA_CLASS_NAME);
+        memset(data, 0, sizeof(*data));
+        data->map = job->map;
+        data->data = job->map.data;
+        data->len = job->map.size;
+        lua_setfield(L, -2, "data");
+    }
+    fs_closeRead(job->read);
+    free(job);
+}
+
 static int l_filesystem_mount(lua_State* L)
 {
     const char* path = luaL_checkstring(L, 1);
@@ -65,6 +203,41 @@ static int l_filesystem_read(lua_State* L)
     return 1;
 }
 
+static int l_filesystem_readAsync(lua_State* L)
+{
+    /* Resolving happens here, the reading on an I/O thread; the result arrives
+     * as a "fileread" event carrying the returned id */
+    const char* filename = luaL_checkstring(L, 1);
+    if(!start_readers())
+    {
+        luaL_error(L, "could not start I/O threads: %s", SDL_GetError());
+    }
+    fs_Read* read;
+    int res = fs_openRead(filename, &read);
+    if(res != FS_ESUCCESS)
+    {
+        lua_pushnil(L);
+        lua_pushfstring(L, "%s '%s'", fs_errorStr(res), filename);
+        return 2;
+    }
+    ReadJob* job = calloc(1, sizeof(*job) + strlen(filename));
+    if(!job)
+    {
+        fs_closeRead(read);
+        luaL_error(L, "out of memory");
+    }
+    job->id = ++readId;
+    job->read = read;
+    strcpy(job->filename, filename);
+    SDL_LockMutex(readLock);
+    *readQueueTail = job;
+    readQueueTail = &job->next;
+    SDL_UnlockMutex(readLock);
+    SDL_SemPost(readSem);
+    lua_pushinteger(L, job->id);
+    return 1;
+}
+
 static int l_filesystem_write(lua_State* L)
 {
     const char* filename = luaL_checkstring(L, 1);
@@ -162,6 +335,7 @@ static const luaL_Reg reg[] = {
     { "read", l_filesystem_read },
     { "exists", l_filesystem_exists },
     { "read", l_filesystem_read },
+    { "readAsync", l_filesystem_readAsync },
     { "write", l_filesystem_write },
     { "delete", l_filesystem_delete },
     { "getSize", l_filesystem_getSize },
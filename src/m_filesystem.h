@@ -0,0 +1,15 @@
+#ifndef M_FILESYSTEM_H
+#define M_FILESYSTEM_H
+
+#include <SDL.h>
+
+#include "luax.h"
+
+/* Event type of completed async reads -- registered on first use, until then
+ * it matches no event */
+extern Uint32 filesystem_readEvent;
+
+/* Fills in the event table on top of the stack from the event's `data1` */
+void filesystem_pushReadEvent(lua_State* L, void* job);
+
+#endif
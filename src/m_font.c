@@ -52,15 +52,14 @@ static int l_font_fromFile(lua_State* L)
     const char* filename = luaL_checkstring(L, 1);
     int fontsize = luaL_optint(L, 2, DEFAULT_FONTSIZE);
     Font* self = font_new(L);
-    size_t len;
-    void* data = fs_read(filename, &len);
+    fs_Map map;
     /* Load new font */
-    if(!data)
+    if(fs_map(filename, &map) != FS_ESUCCESS)
     {
         luaL_error(L, "could not open file '%s'", filename);
     }
-    const char* err = load_font(self, data, len, fontsize);
-    free(data);
+    const char* err = load_font(self, map.data, map.size, fontsize);
+    fs_unmap(&map);
     if(err)
         luaL_error(L, "%s", err);
     return 1;
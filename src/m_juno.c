@@ -17,6 +17,7 @@ static const luaL_Reg mods[] = {
     { "Buffer", luaopen_buffer },
     { "Source", luaopen_source },
     { "Data", luaopen_data },
+    { "File", luaopen_file },
     { "Gif", luaopen_gif },
     { "Joystick", luaopen_joystick_object },
     /* Modules */
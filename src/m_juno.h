@@ -9,6 +9,7 @@ int luaopen_font(lua_State* L);
 int luaopen_buffer(lua_State* L);
 int luaopen_source(lua_State* L);
 int luaopen_data(lua_State* L);
+int luaopen_file(lua_State* L);
 int luaopen_gif(lua_State* L);
 int luaopen_joystick_object(lua_State* L);
 
@@ -24,4 +25,6 @@ int luaopen_joystick(lua_State* L);
 
 int luaopen_juno(lua_State* L);
 
+void audio_close(void);
+
 #endif
\ No newline at end of file
@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <math.h>
 
 #include <SDL.h>
 
@@ -17,20 +19,109 @@
 #define FX_MASK (FX_UNIT - 1)
 #define FX_LERP(a, b, p) ((a) + ((((b) - (a)) * (p)) >> (FX_BITS)))
 
+/* Polyphase windowed-sinc tables: one set of phases per cutoff band so pitching
+ * up filters out what would otherwise alias */
+#define SINC_TAPS 16
+#define SINC_PHASE_BITS 8
+#define SINC_PHASES (1 << SINC_PHASE_BITS)
+#define SINC_BANDS 4
+#define SINC_BITS 14
+#define PI 3.14159265358979323846
+
+/* Frames read behind the position by the widest resampler */
+#define SOURCE_HISTORY (SINC_TAPS / 2 - 1)
+
+/* End of SOURCE_FENDLESS sources, which never reach it on their own: synths
+ * are given an end when their envelope has been released, queues play as long
+ * as they're fed */
+#define ENDLESS_END LLONG_MAX
+
+/* Built by the Lua thread when the sinc resampler is first asked for */
+static short sincTable[SINC_BANDS][SINC_PHASES][SINC_TAPS];
+static int sincReady;
+static const double sincCutoffs[SINC_BANDS] = { 0.95, 0.7, 0.48, 0.3 };
+
 static int samplerate = 44100;
 static Source* master;
 static int masterRef = LUA_NOREF;
 static vec_t(Source*) sources;
+static vec_t(Source*) order;
+/* Mix buffers not held by a source, linked through their first bytes. They're
+ * only ever allocated and freed on the Lua thread, so the mixer never has to;
+ * `poolLock` guards the list. There are as many as there are buses and
+ * sources that may be active at once: `claimed` holds the sources that are
+ * playing or have effects */
+static int* bufferPool;
+static SDL_SpinLock poolLock;
+static int bufferFrames = SOURCE_BUFFER_MAX / 2;
+static int buffersAllocated;
+static int buses;
+static vec_t(Source*) claimed;
+static int lastClaims;
+/* Float mixer: buses and the master accumulate floats, and sources are gained
+ * into them in float rather than fixed-point */
+static int floatMixing;
+/* While no audio device is mixing, commands are applied as they're pushed,
+ * on this state; see source_setDirect() */
+static lua_State* directState;
+/* Float working buffer for effects, only used on the audio thread */
+static float effectBuf[SOURCE_BUFFER_MAX];
+
+/* Decoder thread -- keeps the raw buffers of SOURCE_FASYNC sources filled ahead
+ * of the mixer. `decoderSources` is only touched with `decoderLock` held, which
+ * the audio thread never takes while the decoder runs; sources it has finished
+ * with are handed back through `reaped`. The lock is created along with the
+ * first thread -- until then nothing else can touch the list */
+static SDL_Thread* decoder;
+static SDL_sem* decoderSem;
+static SDL_mutex* decoderLock;
+static SDL_atomic_t decoderActive;
+static SDL_atomic_t decoderQuit;
+static vec_t(Source*) decoderSources;
+static vec_t(Source*) decoderWork;
+static SDL_SpinLock reapedLock;
+static vec_t(Source*) reaped;
+/* Performance counter ticks spent decoding on the mixing thread */
+static Uint64 decodeTicks;
+/* Frames mixed so far -- the time of the first frame of the next block */
+static long long audioClock;
+static SDL_SpinLock clockLock;
+/* Sources that played in the last block, and blocks the decoder thread fell
+ * behind on -- the voices are counted in `blockVoices` while mixing and only
+ * published once the block is done */
+static int blockVoices;
+static SDL_atomic_t activeVoices;
+static SDL_atomic_t underruns;
+static double listenerX, listenerY;
 
 typedef struct
 {
     int type;
     Source* source;
     int i;
-    double f;
+    double f, f2;
     void* p;
+    /* Carried by value so the audio thread never frees anything of ours */
+    union
+    {
+        dsp_Params params;
+        double v[4];
+    };
 } Command;
 
+/* Effects swapped out by the mixer are freed on the Lua thread once the batch
+ * of commands that replaced them is known to have been processed: `batches`
+ * is bumped after every batch, so two bumps past the count seen when the
+ * command was pushed means the mixer is done with the old effect */
+typedef struct
+{
+    dsp_Effect* effect;
+    int batch;
+} RetiredEffect;
+
+static vec_t(RetiredEffect) retired;
+static SDL_atomic_t batches;
+
 enum
 {
     COMMAND_NULL,
@@ -43,7 +134,27 @@ enum
     COMMAND_SET_GAIN,
     COMMAND_SET_PAN,
     COMMAND_SET_RATE,
-    COMMAND_SET_LOOP
+    COMMAND_SET_LOOP,
+    COMMAND_SET_QUALITY,
+    COMMAND_SET_EFFECT,
+    COMMAND_SET_EFFECT_PARAMS,
+    COMMAND_SET_POSITION,
+    COMMAND_SET_ATTENUATION,
+    COMMAND_SET_LISTENER,
+    COMMAND_SET_TAP,
+    COMMAND_NOTE_ON,
+    COMMAND_NOTE_OFF,
+    COMMAND_SET_ENVELOPE,
+    COMMAND_SET_DUTY
+};
+
+enum
+{
+    SYNTH_IDLE,
+    SYNTH_ATTACK,
+    SYNTH_DECAY,
+    SYNTH_SUSTAIN,
+    SYNTH_RELEASE,
 };
 
 static vec_t(Command) commands;
@@ -60,6 +171,12 @@ static Command command(int type, Source* source)
 static void push_command(Command* c)
 {
     vec_push(&commands, *c);
+    /* No audio device to take them? Apply them now rather than let them pile
+     * up for a callback that never comes */
+    if(directState)
+    {
+        source_processCommands(directState);
+    }
 }
 
 static SourceEvent event(int type)
@@ -78,20 +195,80 @@ static void emit_event(Source* s, SourceEvent* e)
     }
 }
 
+static void lock_decoder(void)
+{
+    if(decoderLock)
+    {
+        SDL_LockMutex(decoderLock);
+    }
+}
+
+static void unlock_decoder(void)
+{
+    if(decoderLock)
+    {
+        SDL_UnlockMutex(decoderLock);
+    }
+}
+
+static double attenuate(Source* self, double dist)
+{
+    double ref = self->refDistance;
+    double max = MAX(self->maxDistance, ref);
+    dist = CLAMP(dist, ref, max);
+    switch(self->attenuation)
+    {
+        case SOURCE_ATTENUATION_LINEAR:
+            return (max > ref) ? 1 - self->rolloff * (dist - ref) / (max - ref) : 1;
+        case SOURCE_ATTENUATION_EXPONENTIAL:
+            return pow(dist / ref, -self->rolloff);
+        default:
+            return ref / (ref + self->rolloff * (dist - ref));
+    }
+}
+
 static void recalc_gains(Source* self)
 {
     double left, right;
-    double pan = CLAMP(self->pan, -1, 1);
-    double gain = MAX(self->gain, 0);
+    double pan = self->pan;
+    double gain = self->gain;
+    /* Positional? Attenuate by distance and pan by direction from the
+     * listener; the direction fades to the center within the reference
+     * distance */
+    if(self->flags & SOURCE_FPOSITIONAL)
+    {
+        double dx = self->x - listenerX;
+        double dy = self->y - listenerY;
+        double dist = sqrt(dx * dx + dy * dy);
+        gain *= MAX(attenuate(self, dist), 0);
+        pan += dx / MAX(dist, MAX(self->refDistance, 1e-9));
+    }
+    pan = CLAMP(pan, -1, 1);
+    gain = MAX(gain, 0);
     /* Get linear gains */
     left = ((pan < 0) ? 1 : (1 - pan)) * gain;
     right = ((pan > 0) ? 1 : (1 + pan)) * gain;
     /* Apply curve */
     left = left * left;
     right = right * right;
-    /* Set fixedpoint gains */
-    self->lgain = left * FX_UNIT;
-    self->rgain = right * FX_UNIT;
+    /* Set fixedpoint gains -- the mixer ramps to these over its next block */
+    self->lgainTarget = left * FX_UNIT;
+    self->rgainTarget = right * FX_UNIT;
+    self->lgainfTarget = left;
+    self->rgainfTarget = right;
+}
+
+static void update_positions(void)
+{
+    int i;
+    Source* s;
+    vec_foreach(&sources, s, i)
+    {
+        if(s->flags & SOURCE_FPOSITIONAL)
+        {
+            recalc_gains(s);
+        }
+    }
 }
 
 static Source* check_source(lua_State* L, int idx)
@@ -106,9 +283,20 @@ static Source* new_source(lua_State* L)
     memset(self, 0, sizeof(*self));
     self->dataRef = LUA_NOREF;
     self->destRef = LUA_NOREF;
+    self->flags = SOURCE_FREPLACE;
     self->gain = 1.0;
+    self->channels = 2;
+    self->quality = SOURCE_QUALITY_LINEAR;
     self->pan = 0;
+    self->attenuation = SOURCE_ATTENUATION_INVERSE;
+    self->refDistance = 1;
+    self->maxDistance = 1e30;
+    self->rolloff = 1;
     recalc_gains(self);
+    self->lgain = self->lgainTarget;
+    self->rgain = self->rgainTarget;
+    self->lgainf = self->lgainfTarget;
+    self->rgainf = self->rgainfTarget;
 
     /* Init lua pointer to the actual Source struct */
     Source** p = (Source**)lua_newuserdata(L, sizeof(self));
@@ -117,6 +305,119 @@ static Source* new_source(lua_State* L)
     return self;
 }
 
+static void pool_push(int* buf)
+{
+    SDL_AtomicLock(&poolLock);
+    memcpy(buf, &bufferPool, sizeof(bufferPool));
+    bufferPool = buf;
+    SDL_AtomicUnlock(&poolLock);
+}
+
+static void reserve_buffers(lua_State* L, int extra)
+{
+    /* A source holds at most one buffer; `extra` counts sources about to be
+     * claimed */
+    while(buffersAllocated < claimed.length + buses + extra)
+    {
+        int* buf = malloc(bufferFrames * 2 * sizeof(*buf));
+        if(!buf)
+        {
+            luaL_error(L, "out of memory");
+        }
+        buffersAllocated++;
+        pool_push(buf);
+    }
+}
+
+static void trim_buffers(void)
+{
+    /* Sources only give their buffers back once the mixer has seen them stop,
+     * so keep enough for the last update's count as well */
+    int want = MAX(claimed.length, lastClaims) + buses;
+    lastClaims = claimed.length;
+    while(buffersAllocated > want)
+    {
+        SDL_AtomicLock(&poolLock);
+        int* buf = bufferPool;
+        if(buf)
+        {
+            memcpy(&bufferPool, buf, sizeof(bufferPool));
+        }
+        SDL_AtomicUnlock(&poolLock);
+        if(!buf)
+        {
+            break;
+        }
+        free(buf);
+        buffersAllocated--;
+    }
+}
+
+static void update_claim(lua_State* L, Source* self)
+{
+    /* Buses are always counted. Anything else may be active while it's
+     * playing, or while it has effects whose tails ring on */
+    if(!self->onEvent)
+    {
+        return;
+    }
+    int want = self->luaPlaying;
+    for(int i = 0; i < SOURCE_EFFECT_MAX; i++)
+    {
+        want |= self->luaEffects[i] != 0;
+    }
+    if(want && !self->luaClaimed)
+    {
+        vec_push(&claimed, self);
+        self->luaClaimed = 1;
+        reserve_buffers(L, 0);
+    }
+    else if(!want && self->luaClaimed)
+    {
+        vec_remove(&claimed, self);
+        self->luaClaimed = 0;
+    }
+}
+
+static void set_playing(lua_State* L, Source* self, int playing)
+{
+    /* Played, it counts until the mixer has seen the command and the source
+     * has stopped again; see source_update() */
+    self->luaPlaying = playing;
+    self->luaPlayBatch = SDL_AtomicGet(&batches);
+    update_claim(L, self);
+}
+
+static int* acquire_buffer(void)
+{
+    SDL_AtomicLock(&poolLock);
+    int* buf = bufferPool;
+    if(buf)
+    {
+        memcpy(&bufferPool, buf, sizeof(bufferPool));
+    }
+    SDL_AtomicUnlock(&poolLock);
+    return buf;
+}
+
+static void release_buffer(Source* self)
+{
+    if(self->buf)
+    {
+        pool_push(self->buf);
+        self->buf = NULL;
+    }
+}
+
+static void free_source(Source* self)
+{
+    /* The effects were retired by l_source_gc() and are freed on the Lua thread */
+    release_buffer(self);
+    free(self->rawBuf[0]);
+    free(self->tap);
+    free(self);
+}
+
 static void destroy_source(Source* self)
 {
     /* Note: All the lua references of the source should be unreferenced before
@@ -125,7 +426,7 @@ static void destroy_source(Source* self)
      * place this function should ever be called. */
     SourceEvent e = event(SOURCE_EVENT_DEINIT);
     emit_event(self, &e);
-    free(self);
+    free_source(self);
 }
 
 static double get_baserate(Source* self)
@@ -135,18 +436,107 @@ static double get_baserate(Source* self)
 
 static void rewind_stream(Source* self, long long position)
 {
-    /* Rewind stream */
-    SourceEvent e = event(SOURCE_EVENT_REWIND);
-    emit_event(self, &e);
-
-    /* Process first chunk and reset */
-    e = event(SOURCE_EVENT_PROCESS);
-    e.offset = 0;
-    e.len = SOURCE_BUFFER_MAX / 2;
-    emit_event(self, &e);
-    self->end = self->length;
-    self->bufEnd = e.len;
+    /* Bump the seek generation: whoever decodes the source rewinds the stream
+     * and refills the raw buffer from the start; until then the old contents
+     * are ignored. The history before the start stays the mixer's, so the
+     * decoder leaves it zeroed */
+    self->end = (self->flags & SOURCE_FENDLESS) ? ENDLESS_END : self->length;
+    self->bufEnd = 0;
     self->position = position;
+    SDL_AtomicSet(&self->readPos, (unsigned)-SOURCE_HISTORY);
+    SDL_AtomicAdd(&self->seekGen, 1);
+}
+
+static void stop_source(Source* self)
+{
+    /* Rewind right away rather than on the next play(), so the decoder has the
+     * start ready by then. Queues carry on from where they are */
+    self->state = SOURCE_STATE_STOPPED;
+    if(!(self->flags & SOURCE_FQUEUE) && self->position != 0)
+    {
+        rewind_stream(self, 0);
+    }
+}
+
+static void decode_source(Source* self, long long last)
+{
+    /* Live sources (synths) are generated as they're played: never past
+     * `last`, the last frame the mixer is about to read, so a note starts on
+     * the first frame it hasn't read yet. Everything else is filled in chunks
+     * as far ahead as there's room */
+    int live = self->flags & SOURCE_FLIVE;
+    int chunk = MIN(SOURCE_BUFFER_MAX / 2, (self->rawMask + 1) / 2);
+    int gen = SDL_AtomicGet(&self->seekGen);
+    if(gen != self->decodeGen)
+    {
+        SourceEvent e = event(SOURCE_EVENT_REWIND);
+        emit_event(self, &e);
+        self->decodeGen = gen;
+        self->writePos = 0;
+        /* The resamplers read up to SOURCE_HISTORY frames behind the position,
+         * which at the start are whatever the last pass left there, or were
+         * never written. Play them as silence; the mixer keeps us from writing
+         * there until it has moved past them */
+        for(int c = 0; c < self->channels; c++)
+        {
+            for(int i = 1; i <= SOURCE_HISTORY; i++)
+            {
+                self->rawBuf[c][-i & self->rawMask] = 0;
+            }
+        }
+    }
+    /* Fill as far ahead of the mixer's read position as the buffer allows. The
+     * positions shared with the mixer are 32bit and wrap, only their distance
+     * matters */
+    for(;;)
+    {
+        int room = self->rawMask + 1
+            - (int)(self->writePos - SDL_AtomicGet(&self->readPos));
+        int len = chunk;
+        if(live)
+        {
+            len = MIN(room, (int)((unsigned)last + 1 - self->writePos));
+        }
+        if(len <= 0 || len > room)
+        {
+            break;
+        }
+        SourceEvent e = event(SOURCE_EVENT_PROCESS);
+        e.offset = self->writePos & self->rawMask;
+        e.len = len;
+        emit_event(self, &e);
+        self->writePos += len;
+        SDL_AtomicSet(&self->fillEnd, self->writePos);
+        SDL_AtomicSet(&self->readyGen, gen);
+        /* Rewound meanwhile? Drop what we have and start over next time */
+        if(SDL_AtomicGet(&self->seekGen) != gen)
+        {
+            break;
+        }
+    }
+}
+
+static int fetch_frames(Source* self, long long idx, long long need, long long last)
+{
+    /* Publish how far we've read so the decoder knows how much room it has,
+     * then pick up whatever has been decoded since */
+    SDL_AtomicSet(&self->readPos, (unsigned)(idx - SOURCE_HISTORY));
+    /* Queues are filled from Lua, everything else decodes inline unless the
+     * decoder thread does it for us */
+    if(!(self->flags & SOURCE_FQUEUE)
+        && (!(self->flags & SOURCE_FASYNC) || !SDL_AtomicGet(&decoderActive)))
+    {
+        Uint64 start = SDL_GetPerformanceCounter();
+        decode_source(self, last);
+        decodeTicks += SDL_GetPerformanceCounter() - start;
+    }
+    if(SDL_AtomicGet(&self->readyGen) == SDL_AtomicGet(&self->seekGen))
+    {
+        /* Widen the wrapping fill position back to 64bit around `idx` */
+        unsigned fill = SDL_AtomicGet(&self->fillEnd);
+        self->bufEnd = idx + (int)(fill - (unsigned)idx);
+    }
+    return need < self->bufEnd;
 }
 
 static void onevent_wav(Source* s, SourceEvent* e)
@@ -170,6 +560,7 @@ static void onevent_wav(Source* s, SourceEvent* e)
             }
             s->length = s->wav.length;
             s->samplerate = s->wav.samplerate;
+            s->channels = s->wav.channels;
             break;
         }
         case SOURCE_EVENT_REWIND:
@@ -178,6 +569,7 @@ static void onevent_wav(Source* s, SourceEvent* e)
         case SOURCE_EVENT_PROCESS:
         {
             int i, x;
+            const short* data = s->wav.data;
             for(i = 0; i < e->len; i++)
             {
                 /* Hit the end? Rewind and continue */
@@ -186,18 +578,18 @@ static void onevent_wav(Source* s, SourceEvent* e)
                     s->wavIdx = 0;
                 }
                 /* Process */
-                int idx = (e->offset + i) & SOURCE_BUFFER_MASK;
-                if(s->wav.channels == 2)
+                int idx = (e->offset + i) & s->rawMask;
+                if(s->channels == 2)
                 {
                     /* Process stereo */
                     x = s->wavIdx << 1;
-                    s->rawBufLeft[idx] = ((short *)s->wav.data)[x];
-                    s->rawBufRight[idx] = ((short *)s->wav.data)[x + 1];
+                    s->rawBuf[0][idx] = data[x];
+                    s->rawBuf[1][idx] = data[x + 1];
                 }
                 else
                 {
                     /* Process mono */
-                    s->rawBufLeft[idx] = s->rawBufRight[idx] = ((short *)s->wav.data)[s->wavIdx];
+                    s->rawBuf[0][idx] = data[s->wavIdx];
                 }
                 s->wavIdx++;
             }
@@ -206,6 +598,135 @@ static void onevent_wav(Source* s, SourceEvent* e)
     }
 }
 
+static void set_envelope(Source* s, double attack, double decay, double sustain, double release)
+{
+    /* Times in seconds, converted to per-frame steps; a release is timed from
+     * full level */
+    double sr = s->samplerate;
+    s->synthAttack = 1 / MAX(attack * sr, 1);
+    s->synthDecay = 1 / MAX(decay * sr, 1);
+    s->synthSustain = CLAMP(sustain, 0, 1);
+    s->synthRelease = 1 / MAX(release * sr, 1);
+}
+
+static float synth_oscillator(Source* s)
+{
+    unsigned p = s->synthPhase;
+    float x = p * (1.0f / 4294967296.0f);
+    switch(s->synthWave)
+    {
+        case SOURCE_WAVE_SQUARE:
+            return p < s->synthDuty ? 1 : -1;
+        case SOURCE_WAVE_TRIANGLE:
+            return x < 0.5f ? 4 * x - 1 : 3 - 4 * x;
+        case SOURCE_WAVE_SAW:
+            return 2 * x - 1;
+        case SOURCE_WAVE_NOISE:
+            return (s->synthNoise & 1) ? 1 : -1;
+        default:
+        {
+            int i = p >> (32 - SOURCE_WAVETABLE_BITS);
+            int frac = (p >> (32 - SOURCE_WAVETABLE_BITS - 16)) & 0xffff;
+            int a = s->synthTable[i];
+            int b = s->synthTable[(i + 1) & (SOURCE_WAVETABLE_SIZE - 1)];
+            return (a + (((b - a) * frac) >> 16)) * (1.0f / 32768);
+        }
+    }
+}
+
+static void synth_envelope(Source* s)
+{
+    switch(s->synthStage)
+    {
+        case SYNTH_ATTACK:
+            if((s->synthEnv += s->synthAttack) >= 1)
+            {
+                s->synthEnv = 1;
+                s->synthStage = SYNTH_DECAY;
+            }
+            break;
+        case SYNTH_DECAY:
+            if((s->synthEnv -= s->synthDecay) <= s->synthSustain)
+            {
+                s->synthEnv = s->synthSustain;
+                s->synthStage = SYNTH_SUSTAIN;
+            }
+            break;
+        case SYNTH_RELEASE:
+            if((s->synthEnv -= s->synthRelease) <= 0)
+            {
+                /* Released: the source stops once the mixer gets here */
+                s->synthEnv = 0;
+                s->synthStage = SYNTH_IDLE;
+                s->end = s->synthFrame;
+            }
+            break;
+    }
+}
+
+static void onevent_synth(Source* s, SourceEvent* e)
+{
+    switch(e->type)
+    {
+        case SOURCE_EVENT_INIT:
+            s->samplerate = samplerate;
+            s->channels = 1;
+            s->flags |= SOURCE_FENDLESS | SOURCE_FLIVE;
+            s->rawMask = SOURCE_SYNTH_BUFFER - 1;
+            s->synthDuty = 0x80000000u;
+            s->synthNoise = 1;
+            s->synthVelocity = 1;
+            set_envelope(s, 0.005, 0, 1, 0.05);
+            break;
+        case SOURCE_EVENT_DEINIT:
+            free(s->synthTable);
+            break;
+        case SOURCE_EVENT_REWIND:
+            s->synthFrame = 0;
+            break;
+        case SOURCE_EVENT_PROCESS:
+        {
+            int i;
+            for(i = 0; i < e->len; i++)
+            {
+                int idx = (e->offset + i) & s->rawMask;
+                if(s->synthStage == SYNTH_IDLE)
+                {
+                    s->rawBuf[0][idx] = 0;
+                    s->synthFrame++;
+                    continue;
+                }
+                float x = synth_oscillator(s) * s->synthEnv * s->synthVelocity;
+                s->rawBuf[0][idx] = CLAMP(x * 32767, -32768, 32767);
+                /* Noise is clocked at the oscillator's frequency: one step of a
+                 * 15bit LFSR per cycle */
+                unsigned p = s->synthPhase;
+                s->synthPhase += s->synthInc;
+                if(s->synthPhase < p)
+                {
+                    unsigned bit = (s->synthNoise ^ (s->synthNoise >> 1)) & 1;
+                    s->synthNoise = (s->synthNoise >> 1) | (bit << 14);
+                }
+                synth_envelope(s);
+                s->synthFrame++;
+            }
+            break;
+        }
+    }
+}
+
+static void onevent_queue(Source* s, SourceEvent* e)
+{
+    /* Channels, samplerate and buffer size are set by newQueue(); frames
+     * never come from here */
+    if(e->type == SOURCE_EVENT_INIT)
+    {
+        s->flags |= SOURCE_FQUEUE | SOURCE_FENDLESS;
+        /* Never rewound, so this is its only end */
+        s->end = ENDLESS_END;
+    }
+}
+
 static void onevent_ogg(Source* s, SourceEvent* e)
 {
     switch (e->type)
@@ -213,6 +734,11 @@ static void onevent_ogg(Source* s, SourceEvent* e)
         case SOURCE_EVENT_INIT:
         {
             int err;
+            /* stb_vorbis takes an int length */
+            if(s->data->len > INT_MAX)
+            {
+                luaL_error(e->luaState, "could not init ogg stream; data too large");
+            }
             s->oggStream = stb_vorbis_open_memory(s->data->data, s->data->len, &err, NULL);
             if(!s->oggStream)
             {
@@ -220,6 +746,7 @@ static void onevent_ogg(Source* s, SourceEvent* e)
             }
             stb_vorbis_info info = stb_vorbis_get_info(s->oggStream);
             s->samplerate = info.sample_rate;
+            s->channels = (info.channels == 1) ? 1 : 2;
             s->length = stb_vorbis_stream_length_in_samples(s->oggStream);
             break;
         }
@@ -236,16 +763,20 @@ static void onevent_ogg(Source* s, SourceEvent* e)
         {
             int i, n;
             short buf[SOURCE_BUFFER_MAX];
-            int len = e->len * 2;
+            int channels = s->channels;
+            int len = e->len * channels;
             int z = e->offset;
         fill:
-            n = stb_vorbis_get_samples_short_interleaved(s->oggStream, 2, buf, len);
-            n *= 2;
-            for(i = 0; i < n; i += 2)
+            n = stb_vorbis_get_samples_short_interleaved(s->oggStream, channels, buf, len);
+            n *= channels;
+            for(i = 0; i < n; i += channels)
             {
-                int idx = z++ & SOURCE_BUFFER_MASK;
-                s->rawBufLeft[idx] = buf[i];
-                s->rawBufRight[idx] = buf[i + 1];
+                int idx = z++ & s->rawMask;
+                s->rawBuf[0][idx] = buf[i];
+                if(channels == 2)
+                {
+                    s->rawBuf[1][idx] = buf[i + 1];
+                }
             }
             /* Reached end of stream before the end of the buffer? rewind and fill
             * remaining buffer */
@@ -260,65 +791,544 @@ static void onevent_ogg(Source* s, SourceEvent* e)
     }
 }
 
-Source* source_getMaster(int* ref)
+static int fill_stream_buffer(Source* s)
 {
-    if(ref)
+    /* Move unconsumed bytes to the front of the window and top it up from the
+     * stream; returns the number of new bytes read */
+    int left = s->streamBufLen - s->streamBufPos;
+    memmove(s->streamBuf, s->streamBuf + s->streamBufPos, left);
+    s->streamBufPos = 0;
+    s->streamBufLen = left;
+    int n = fs_readStream(s->stream, s->streamBuf + left, SOURCE_STREAM_WINDOW - left);
+    s->streamBufLen += n;
+    return n;
+}
+
+static int open_ogg_stream(Source* s)
+{
+    int used, err;
+    fs_seekStream(s->stream, 0);
+    s->streamBufPos = s->streamBufLen = 0;
+    s->streamOutIdx = s->streamOutLen = 0;
+    s->streamIdx = 0;
+    if(s->streamOgg)
     {
-        *ref = masterRef;
+        stb_vorbis_close(s->streamOgg);
+        s->streamOgg = NULL;
     }
-    return master;
+    /* Feed the decoder an increasingly larger block until it has all the
+     * headers it needs */
+    while(fill_stream_buffer(s) > 0)
+    {
+        s->streamOgg = stb_vorbis_open_pushdata(s->streamBuf, s->streamBufLen, &used, &err, NULL);
+        if(s->streamOgg)
+        {
+            s->streamBufPos = used;
+            return 0;
+        }
+        if(err != VORBIS_need_more_data)
+        {
+            break;
+        }
+    }
+    return -1;
 }
 
-void source_setSamplerate(int sr)
+static int ogg_stream_length(Source* s)
 {
-    samplerate = sr;
+    /* The granule position of the last page is the length in samples */
+    size_t size = fs_streamSize(s->stream);
+    size_t start = size > SOURCE_STREAM_WINDOW ? size - SOURCE_STREAM_WINDOW : 0;
+    long long granule = -1;
+    int i, n;
+    fs_seekStream(s->stream, start);
+    n = fs_readStream(s->stream, s->streamBuf, size - start);
+    for(i = n - 14; i >= 0; i--)
+    {
+        unsigned char* p = s->streamBuf + i;
+        if(!memcmp(p, "OggS", 4))
+        {
+            int j;
+            granule = 0;
+            for(j = 7; j >= 0; j--)
+            {
+                granule = (granule << 8) | p[6 + j];
+            }
+            break;
+        }
+    }
+    return (int)granule;
 }
 
-void source_processCommands(lua_State* L)
+static void onevent_oggstream(Source* s, SourceEvent* e)
 {
-    int i;
-    Command* c;
-    vec_t(int) oldRefs;
-    vec_init(&oldRefs);
-
-    /* Handle commands */
-    vec_foreach_ptr(&commands, c, i)
+    switch(e->type)
     {
-        switch(c->type)
+        case SOURCE_EVENT_INIT:
         {
-            case COMMAND_ADD:
-                vec_push(&sources, c->source);
-                break;
-            case COMMAND_DESTROY:
-                vec_push(&oldRefs, c->source->dataRef);
-                vec_push(&oldRefs, c->source->destRef);
-                vec_remove(&sources, c->source);
-                destroy_source(c->source);
-                break;
-            case COMMAND_PLAY:
-                if(c->i || c->source->state == SOURCE_STATE_STOPPED)
+            s->streamBuf = malloc(SOURCE_STREAM_WINDOW);
+            if(!s->streamBuf)
+            {
+                luaL_error(e->luaState, "out of memory");
+            }
+            s->length = ogg_stream_length(s);
+            if(s->length <= 0 || open_ogg_stream(s) != 0)
+            {
+                luaL_error(e->luaState, "could not init ogg stream; bad data?");
+            }
+            stb_vorbis_info info = stb_vorbis_get_info(s->streamOgg);
+            s->samplerate = info.sample_rate;
+            s->channels = (info.channels == 1) ? 1 : 2;
+            break;
+        }
+        case SOURCE_EVENT_DEINIT:
+            if(s->streamOgg)
+            {
+                stb_vorbis_close(s->streamOgg);
+            }
+            if(s->stream)
+            {
+                fs_closeStream(s->stream);
+            }
+            free(s->streamBuf);
+            break;
+        case SOURCE_EVENT_REWIND:
+            open_ogg_stream(s);
+            break;
+        case SOURCE_EVENT_PROCESS:
+        {
+            int i = 0;
+            int z = e->offset;
+            while(i < e->len)
+            {
+                /* Reached the end of the stream? Rewind so the raw buffer keeps
+                 * filling in a loop */
+                if(s->streamIdx >= s->length)
                 {
-                    rewind_stream(c->source, 0);
+                    open_ogg_stream(s);
                 }
-                c->source->state = SOURCE_STATE_PLAYING;
-                break;
-            case COMMAND_PAUSE:
-                if(c->source->state == SOURCE_STATE_PLAYING)
+                /* Copy out what is left of the last decoded frame */
+                if(s->streamOutIdx < s->streamOutLen)
                 {
-                    c->source->state = SOURCE_STATE_PAUSED;
+                    float* l = s->streamOut[0] + s->streamOutIdx;
+                    float* r = s->streamOut[s->streamChannels > 1] + s->streamOutIdx;
+                    int n = MIN(s->streamOutLen - s->streamOutIdx, e->len - i);
+                    n = MIN(n, s->length - s->streamIdx);
+                    for(int j = 0; j < n; j++)
+                    {
+                        int idx = z++ & s->rawMask;
+                        s->rawBuf[0][idx] = CLAMP(l[j] * 32767.f, -32768, 32767);
+                        if(s->channels == 2)
+                        {
+                            s->rawBuf[1][idx] = CLAMP(r[j] * 32767.f, -32768, 32767);
+                        }
+                    }
+                    s->streamOutIdx += n;
+                    s->streamIdx += n;
+                    i += n;
+                    continue;
                 }
-                else if(c->source->state == SOURCE_STATE_PAUSED)
+                /* Decode the next frame, reading more of the file when the
+                 * decoder runs out of data */
+                int channels, samples;
+                int used = stb_vorbis_decode_frame_pushdata(s->streamOgg,
+                    s->streamBuf + s->streamBufPos, s->streamBufLen - s->streamBufPos,
+                    &channels, &s->streamOut, &samples);
+                s->streamBufPos += used;
+                s->streamChannels = channels;
+                s->streamOutIdx = 0;
+                s->streamOutLen = samples;
+                if(used == 0 && samples == 0 && fill_stream_buffer(s) == 0)
                 {
-                    c->source->state = SOURCE_STATE_PLAYING;
+                    /* Out of data before reaching the length: pad with silence */
+                    int idx = z++ & s->rawMask;
+                    s->rawBuf[0][idx] = 0;
+                    if(s->channels == 2)
+                    {
+                        s->rawBuf[1][idx] = 0;
+                    }
+                    s->streamIdx++;
+                    i++;
                 }
-                break;
+            }
+            break;
+        }
+    }
+}
+
+static int read_wav_header(Source* s)
+{
+    /* Walk the RIFF chunks until we've seen both "fmt " and "data" */
+    unsigned char h[16];
+    int haveFmt = 0;
+    size_t ofs = 12;
+    if(fs_readStream(s->stream, h, 12) != 12 || memcmp(h, "RIFF", 4) || memcmp(h + 8, "WAVE", 4))
+    {
+        return WAV_EBADHEADER;
+    }
+    for(;;)
+    {
+        fs_seekStream(s->stream, ofs);
+        if(fs_readStream(s->stream, h, 8) != 8)
+        {
+            return haveFmt ? WAV_ENODATA : WAV_ENOFMT;
+        }
+        size_t size = h[4] | (h[5] << 8) | (h[6] << 16) | ((size_t)h[7] << 24);
+        if(!memcmp(h, "fmt ", 4))
+        {
+            if(fs_readStream(s->stream, h, 16) != 16)
+            {
+                return WAV_EBADFMT;
+            }
+            if((h[0] | (h[1] << 8)) != 1)
+            {
+                return WAV_ENOSUPPORT;
+            }
+            s->streamWav.channels = h[2] | (h[3] << 8);
+            s->streamWav.samplerate = h[4] | (h[5] << 8) | (h[6] << 16) | (h[7] << 24);
+            s->streamWav.bitdepth = h[14] | (h[15] << 8);
+            if(!s->streamWav.channels || !s->streamWav.samplerate || !s->streamWav.bitdepth)
+            {
+                return WAV_EBADFMT;
+            }
+            haveFmt = 1;
+        }
+        else if(!memcmp(h, "data", 4))
+        {
+            if(!haveFmt)
+            {
+                return WAV_ENOFMT;
+            }
+            s->streamDataOfs = ofs + 8;
+            s->streamWav.length = (size / (s->streamWav.bitdepth / 8)) / s->streamWav.channels;
+            return WAV_ESUCCESS;
+        }
+        ofs += 8 + size + (size & 1);
+    }
+}
+
+static void onevent_wavstream(Source* s, SourceEvent* e)
+{
+    switch(e->type)
+    {
+        case SOURCE_EVENT_INIT:
+        {
+            int err = read_wav_header(s);
+            if(err != WAV_ESUCCESS)
+            {
+                luaL_error(e->luaState, "could not init wav stream: %s", wav_strerror(err));
+            }
+            if(s->streamWav.bitdepth != 16)
+            {
+                luaL_error(e->luaState, "could not init wav stream, expected 16bit wave");
+            }
+            if(s->streamWav.channels != 1 && s->streamWav.channels != 2)
+            {
+                luaL_error(e->luaState, "could not init wav stream, expected mono/stereo wave");
+            }
+            s->length = s->streamWav.length;
+            s->samplerate = s->streamWav.samplerate;
+            s->channels = s->streamWav.channels;
+            fs_seekStream(s->stream, s->streamDataOfs);
+            break;
+        }
+        case SOURCE_EVENT_DEINIT:
+            if(s->stream)
+            {
+                fs_closeStream(s->stream);
+            }
+            break;
+        case SOURCE_EVENT_REWIND:
+            s->streamIdx = 0;
+            fs_seekStream(s->stream, s->streamDataOfs);
+            break;
+        case SOURCE_EVENT_PROCESS:
+        {
+            short buf[SOURCE_BUFFER_MAX];
+            int channels = s->channels;
+            int i = 0;
+            int z = e->offset;
+            while(i < e->len)
+            {
+                /* Hit the end? Rewind and continue */
+                if(s->streamIdx >= s->length)
+                {
+                    s->streamIdx = 0;
+                    fs_seekStream(s->stream, s->streamDataOfs);
+                }
+                int n = MIN(e->len - i, s->length - s->streamIdx);
+                n = MIN(n, SOURCE_BUFFER_MAX / channels);
+                int got = fs_readStream(s->stream, buf, n * channels * sizeof(short));
+                got /= channels * sizeof(short);
+                /* Short read? Pad the rest of the chunk with silence */
+                memset(buf + got * channels, 0, (n - got) * channels * sizeof(short));
+                for(int j = 0; j < n; j++)
+                {
+                    int idx = z++ & s->rawMask;
+                    s->rawBuf[0][idx] = buf[j * channels];
+                    if(channels == 2)
+                    {
+                        s->rawBuf[1][idx] = buf[j * channels + 1];
+                    }
+                }
+                s->streamIdx += n;
+                i += n;
+            }
+            break;
+        }
+    }
+}
+
+Source* source_getMaster(int* ref)
+{
+    if(ref)
+    {
+        *ref = masterRef;
+    }
+    return master;
+}
+
+void source_setSamplerate(int sr)
+{
+    samplerate = sr;
+}
+
+int source_getSamplerate(void)
+{
+    return samplerate;
+}
+
+void source_setBufferSize(int frames)
+{
+    /* Pooled buffers all share one size, fixed once the first is allocated */
+    if(buffersAllocated == 0)
+    {
+        bufferFrames = CLAMP(frames, 1, SOURCE_BUFFER_MAX / 2);
+    }
+}
+
+int source_getBufferSize(void)
+{
+    return bufferFrames;
+}
+
+void source_setFloatMixing(int enable)
+{
+    /* Only safe while the mixer isn't running */
+    floatMixing = enable;
+}
+
+int source_getFloatMixing(void)
+{
+    return floatMixing;
+}
+
+void source_setDirect(lua_State* L)
+{
+    /* Set until audio is inited, or for good if it never is; only safe while
+     * the mixer isn't running */
+    directState = L;
+}
+
+double source_getTime(void)
+{
+    SDL_AtomicLock(&clockLock);
+    long long t = audioClock;
+    SDL_AtomicUnlock(&clockLock);
+    return (double)t / samplerate;
+}
+
+void source_setListener(double x, double y)
+{
+    Command c = command(COMMAND_SET_LISTENER, NULL);
+    c.f = x;
+    c.f2 = y;
+    push_command(&c);
+}
+
+static void free_retired_effects(void)
+{
+    int i;
+    int batch = SDL_AtomicGet(&batches);
+    for(i = 0; i < retired.length; i++)
+    {
+        if(batch - retired.data[i].batch >= 2)
+        {
+            dsp_destroy(retired.data[i].effect);
+            vec_splice(&retired, i, 1);
+            i--;
+        }
+    }
+}
+
+static void retire_effect(Source* self, int slot)
+{
+    /* Called before the command replacing the slot's effect, or destroying its
+     * source, is pushed */
+    free_retired_effects();
+    if(self->luaEffectPtrs[slot])
+    {
+        RetiredEffect r;
+        r.effect = self->luaEffectPtrs[slot];
+        r.batch = SDL_AtomicGet(&batches);
+        vec_push(&retired, r);
+    }
+}
+
+void source_update(void)
+{
+    /* Lua thread housekeeping, once a frame: sources the mixer has seen stop
+     * no longer count as playing, and effects and buffers nothing may need are
+     * freed */
+    int i;
+    Source* s;
+    int batch = SDL_AtomicGet(&batches);
+    vec_foreach_rev(&claimed, s, i)
+    {
+        if(s->luaPlaying && batch - s->luaPlayBatch >= 2
+            && s->state != SOURCE_STATE_PLAYING)
+        {
+            s->luaPlaying = 0;
+            update_claim(NULL, s);
+        }
+    }
+    free_retired_effects();
+    trim_buffers();
+}
+
+int source_getActiveVoices(void)
+{
+    return SDL_AtomicGet(&activeVoices);
+}
+
+int source_getUnderruns(void)
+{
+    return SDL_AtomicGet(&underruns);
+}
+
+double source_getDecodeTime(void)
+{
+    return decodeTicks / (double)SDL_GetPerformanceFrequency();
+}
+
+static void sort_sources(void)
+{
+    /* Every source must be processed before its destination, so sources deeper
+     * in the routing tree go first. Sources of equal depth keep the newest-first
+     * order */
+    int i, d;
+    int maxDepth = 0;
+    Source* s;
+    vec_foreach(&sources, s, i)
+    {
+        s->depth = 0;
+        Source* dest = s->dest;
+        while(dest && s->depth < sources.length)
+        {
+            s->depth++;
+            dest = dest->dest;
+        }
+        maxDepth = MAX(maxDepth, s->depth);
+    }
+    vec_clear(&order);
+    for(d = maxDepth; d >= 0; d--)
+    {
+        vec_foreach_rev(&sources, s, i)
+        {
+            if(s->depth == d)
+            {
+                vec_push(&order, s);
+            }
+        }
+    }
+}
+
+void source_processCommands(lua_State* L)
+{
+    int i;
+    int reorder = 0;
+    int moved = 0;
+    Command* c;
+    vec_t(int) oldRefs;
+    vec_init(&oldRefs);
+
+    /* Free sources the decoder thread has finished with */
+    SDL_AtomicLock(&reapedLock);
+    Source* r;
+    vec_foreach(&reaped, r, i)
+    {
+        vec_push(&oldRefs, r->dataRef);
+        vec_push(&oldRefs, r->destRef);
+        free_source(r);
+    }
+    vec_clear(&reaped);
+    SDL_AtomicUnlock(&reapedLock);
+
+    /* Handle commands */
+    vec_foreach_ptr(&commands, c, i)
+    {
+        switch(c->type)
+        {
+            case COMMAND_ADD:
+                vec_push(&sources, c->source);
+                reorder = 1;
+                break;
+            case COMMAND_DESTROY:
+                vec_remove(&sources, c->source);
+                reorder = 1;
+                /* No longer mixed: its buffer is free even if the decoder
+                 * thread holds on to the source a while longer */
+                release_buffer(c->source);
+                /* Still owned by the decoder thread? It deinits the source and
+                 * hands it back to be freed */
+                if((c->source->flags & SOURCE_FASYNC) && SDL_AtomicGet(&decoderActive))
+                {
+                    SDL_AtomicSet(&c->source->dead, 1);
+                    break;
+                }
+                if(c->source->flags & SOURCE_FASYNC)
+                {
+                    lock_decoder();
+                    vec_remove(&decoderSources, c->source);
+                    unlock_decoder();
+                }
+                vec_push(&oldRefs, c->source->dataRef);
+                vec_push(&oldRefs, c->source->destRef);
+                destroy_source(c->source);
+                break;
+            case COMMAND_PLAY:
+                /* Queues carry on with whatever they've been fed. Anything
+                 * still at the start was rewound when it stopped, or never
+                 * played: what has been decoded ahead is good to play */
+                if(!(c->source->flags & SOURCE_FQUEUE)
+                    && (c->i || c->source->state == SOURCE_STATE_STOPPED)
+                    && c->source->position != 0)
+                {
+                    rewind_stream(c->source, 0);
+                }
+                c->source->state = SOURCE_STATE_PLAYING;
+                /* Scheduled? Playback starts on that exact frame of the clock,
+                 * a time already passed starts right away */
+                c->source->startTime = (c->f > audioClock) ? (long long)(c->f + 0.5) : 0;
+                break;
+            case COMMAND_PAUSE:
+                if(c->source->state == SOURCE_STATE_PLAYING)
+                {
+                    c->source->state = SOURCE_STATE_PAUSED;
+                }
+                else if(c->source->state == SOURCE_STATE_PAUSED)
+                {
+                    c->source->state = SOURCE_STATE_PLAYING;
+                }
+                break;
             case COMMAND_STOP:
-                c->source->state = SOURCE_STATE_STOPPED;
+                stop_source(c->source);
                 break;
             case COMMAND_SET_DESTINATION:
                 vec_push(&oldRefs, c->source->destRef);
                 c->source->destRef = c->i;
                 c->source->dest = c->p;
+                reorder = 1;
                 break;
             case COMMAND_SET_GAIN:
                 c->source->gain = c->f;
@@ -331,6 +1341,81 @@ void source_processCommands(lua_State* L)
             case COMMAND_SET_RATE:
                 c->source->rate = get_baserate(c->source) * c->f * FX_UNIT;
                 break;
+            case COMMAND_SET_QUALITY:
+                c->source->quality = c->i;
+                break;
+            case COMMAND_SET_EFFECT:
+                /* The old effect is freed by the Lua thread, see `retired` */
+                c->source->effects[c->i] = c->p;
+                if(c->p)
+                {
+                    c->source->effectMask |= 1 << c->i;
+                }
+                else
+                {
+                    c->source->effectMask &= ~(1 << c->i);
+                }
+                break;
+            case COMMAND_SET_EFFECT_PARAMS:
+                if(c->source->effects[c->i])
+                {
+                    dsp_setParams(c->source->effects[c->i], &c->params);
+                }
+                break;
+            case COMMAND_SET_POSITION:
+                if(c->i)
+                {
+                    c->source->flags |= SOURCE_FPOSITIONAL;
+                    c->source->x = c->f;
+                    c->source->y = c->f2;
+                }
+                else
+                {
+                    c->source->flags &= ~SOURCE_FPOSITIONAL;
+                }
+                recalc_gains(c->source);
+                break;
+            case COMMAND_SET_ATTENUATION:
+                c->source->attenuation = c->i;
+                c->source->refDistance = c->v[0];
+                c->source->maxDistance = c->v[1];
+                c->source->rolloff = c->v[2];
+                recalc_gains(c->source);
+                break;
+            case COMMAND_SET_LISTENER:
+                listenerX = c->f;
+                listenerY = c->f2;
+                moved = 1;
+                break;
+            case COMMAND_SET_TAP:
+                c->source->tap = c->p;
+                break;
+            case COMMAND_NOTE_ON:
+            {
+                Source* s = c->source;
+                s->synthInc = c->f / s->samplerate * 4294967296.0;
+                s->synthVelocity = c->f2;
+                s->synthStage = SYNTH_ATTACK;
+                /* Nothing is generated past what the mixer has read, so the
+                 * note simply carries on from there. A finished release may
+                 * have ended the source */
+                s->end = ENDLESS_END;
+                s->state = SOURCE_STATE_PLAYING;
+                s->startTime = 0;
+                break;
+            }
+            case COMMAND_NOTE_OFF:
+                if(c->source->synthStage != SYNTH_IDLE)
+                {
+                    c->source->synthStage = SYNTH_RELEASE;
+                }
+                break;
+            case COMMAND_SET_ENVELOPE:
+                set_envelope(c->source, c->v[0], c->v[1], c->v[2], c->v[3]);
+                break;
+            case COMMAND_SET_DUTY:
+                c->source->synthDuty = CLAMP(c->f, 0, 1) * 4294967295.0;
+                break;
             case COMMAND_SET_LOOP:
                 if(c->i)
                 {
@@ -346,6 +1431,19 @@ void source_processCommands(lua_State* L)
 
     /* Clear command vector */
     vec_clear(&commands);
+    SDL_AtomicAdd(&batches, 1);
+
+    /* Routing changed? Recompute the processing order */
+    if(reorder)
+    {
+        sort_sources();
+    }
+
+    /* Listener moved? Update every positional source at once */
+    if(moved)
+    {
+        update_positions();
+    }
 
     /* Remove old Lua references */
     if(oldRefs.length > 0)
@@ -359,79 +1457,549 @@ void source_processCommands(lua_State* L)
     vec_deinit(&oldRefs);
 }
 
+static void init_sinc_tables(void)
+{
+    int b, p, t;
+    if(sincReady)
+        return;
+    for(b = 0; b < SINC_BANDS; b++)
+    {
+        double fc = sincCutoffs[b];
+        for(p = 0; p < SINC_PHASES; p++)
+        {
+            double h[SINC_TAPS], sum = 0;
+            double frac = (double)p / SINC_PHASES;
+            for(t = 0; t < SINC_TAPS; t++)
+            {
+                /* Distance of this tap from the interpolated position */
+                double x = t - SOURCE_HISTORY - frac;
+                double u = x / (SINC_TAPS / 2);
+                double w = 0.42 + 0.5 * cos(PI * u) + 0.08 * cos(2 * PI * u);
+                double s = (x == 0) ? 1 : sin(PI * fc * x) / (PI * fc * x);
+                h[t] = (fabs(u) < 1) ? fc * s * w : 0;
+                sum += h[t];
+            }
+            /* Normalize so each phase has unity gain at DC */
+            for(t = 0; t < SINC_TAPS; t++)
+            {
+                sincTable[b][p][t] = floor(h[t] / sum * (1 << SINC_BITS) + 0.5);
+            }
+        }
+    }
+    sincReady = 1;
+}
+
+static int resampler_lookahead(Source* self)
+{
+    if(self->rate == FX_UNIT && !(self->position & FX_MASK))
+    {
+        return 0;
+    }
+    switch(self->quality)
+    {
+        case SOURCE_QUALITY_NEAREST:
+            return 0;
+        case SOURCE_QUALITY_CUBIC:
+            return 2;
+        case SOURCE_QUALITY_SINC:
+            return SINC_TAPS - SOURCE_HISTORY - 1;
+        default:
+            return 1;
+    }
+}
+
+static void resample_copy(Source* self, const short* src, int* dst, int stride, int n)
+{
+    int i;
+    int mask = self->rawMask;
+    int idx = self->position >> FX_BITS;
+    for(i = 0; i < n; i++)
+    {
+        dst[i * stride] += src[(idx + i) & mask];
+    }
+}
+
+static void resample_nearest(Source* self, const short* src, int* dst, int stride, int n)
+{
+    int i;
+    int mask = self->rawMask;
+    long long pos = self->position;
+    for(i = 0; i < n; i++)
+    {
+        dst[i * stride] += src[(pos >> FX_BITS) & mask];
+        pos += self->rate;
+    }
+}
+
+static void resample_linear(Source* self, const short* src, int* dst, int stride, int n)
+{
+    int i;
+    int mask = self->rawMask;
+    long long pos = self->position;
+    for(i = 0; i < n; i++)
+    {
+        int idx = pos >> FX_BITS;
+        int p = pos & FX_MASK;
+        int a = src[idx & mask];
+        int b = src[(idx + 1) & mask];
+        dst[i * stride] += FX_LERP(a, b, p);
+        pos += self->rate;
+    }
+}
+
+static int cubic(const short* x, int i0, int i1, int i2, int i3, long long p)
+{
+    /* Catmull-Rom spline through x[i1] and x[i2]; coefficients are doubled to
+     * stay in integers */
+    long long a = x[i2] - x[i0];
+    long long b = 2 * x[i0] - 5 * x[i1] + 4 * x[i2] - x[i3];
+    long long c = 3 * (x[i1] - x[i2]) + x[i3] - x[i0];
+    return x[i1] + ((((((c * p) >> FX_BITS) + b) * p >> FX_BITS) + a) * p >> (FX_BITS + 1));
+}
+
+static void resample_cubic(Source* self, const short* src, int* dst, int stride, int n)
+{
+    int i;
+    int mask = self->rawMask;
+    long long pos = self->position;
+    for(i = 0; i < n; i++)
+    {
+        int idx = pos >> FX_BITS;
+        int p = pos & FX_MASK;
+        int i0 = (idx - 1) & mask;
+        int i1 = idx & mask;
+        int i2 = (idx + 1) & mask;
+        int i3 = (idx + 2) & mask;
+        dst[i * stride] += cubic(src, i0, i1, i2, i3, p);
+        pos += self->rate;
+    }
+}
+
+static void resample_sinc(Source* self, const short* src, int* dst, int stride, int n)
+{
+    int i, t;
+    int mask = self->rawMask;
+    long long pos = self->position;
+    /* Pick the cutoff band from how fast we're stepping through the source */
+    int band = 0;
+    while(band < SINC_BANDS - 1 && self->rate * sincCutoffs[band] > FX_UNIT * 0.95)
+    {
+        band++;
+    }
+    for(i = 0; i < n; i++)
+    {
+        int base = (pos >> FX_BITS) - SOURCE_HISTORY;
+        const short* c = sincTable[band][(pos & FX_MASK) >> (FX_BITS - SINC_PHASE_BITS)];
+        int x = 0;
+        for(t = 0; t < SINC_TAPS; t++)
+        {
+            x += src[(base + t) & mask] * c[t];
+        }
+        dst[i * stride] += x >> SINC_BITS;
+        pos += self->rate;
+    }
+}
+
+static void resample(Source* self, int* dst, int width, int n)
+{
+    int c;
+    /* Playing at exactly the source's rate on a whole frame? Nothing to
+     * interpolate */
+    int copy = self->rate == FX_UNIT && !(self->position & FX_MASK);
+    /* Resample each channel into its lane of the `width`-channel buffer; a mono
+     * source only fills both lanes of a stereo buffer */
+    for(c = 0; c < width; c++)
+    {
+        const short* src = self->rawBuf[MIN(c, self->channels - 1)];
+        if(copy)
+        {
+            resample_copy(self, src, dst + c, width, n);
+            continue;
+        }
+        switch(self->quality)
+        {
+            case SOURCE_QUALITY_NEAREST:
+                resample_nearest(self, src, dst + c, width, n);
+                break;
+            case SOURCE_QUALITY_CUBIC:
+                resample_cubic(self, src, dst + c, width, n);
+                break;
+            case SOURCE_QUALITY_SINC:
+                resample_sinc(self, src, dst + c, width, n);
+                break;
+            default:
+                resample_linear(self, src, dst + c, width, n);
+                break;
+        }
+    }
+    self->position += (long long)self->rate * n;
+}
+
+static void apply_gains(Source* self, int* dst, int frames, int width, int add)
+{
+    /* Writes our `width`-channel buffer to the stereo `dst` with the gains
+     * applied, ramping from the current to the target gains across the block
+     * so changes don't click. Runs backwards so a mono buffer can be spread to
+     * stereo in place */
+    int i;
+    int* src = self->buf;
+    if(frames <= 0)
+    {
+        return;
+    }
+    long long l0 = (long long)self->lgain << 16;
+    long long r0 = (long long)self->rgain << 16;
+    long long ls = (((long long)self->lgainTarget << 16) - l0) / frames;
+    long long rs = (((long long)self->rgainTarget << 16) - r0) / frames;
+    for(i = frames - 1; i >= 0; i--)
+    {
+        int l = (l0 + ls * i) >> 16;
+        int r = (r0 + rs * i) >> 16;
+        int xl = (src[i * width] * l) >> FX_BITS;
+        int xr = (src[i * width + width - 1] * r) >> FX_BITS;
+        if(add)
+        {
+            dst[i * 2] += xl;
+            dst[i * 2 + 1] += xr;
+        }
+        else
+        {
+            dst[i * 2] = xl;
+            dst[i * 2 + 1] = xr;
+        }
+    }
+    self->lgain = self->lgainTarget;
+    self->rgain = self->rgainTarget;
+}
+
+static void apply_gains_float(Source* self, float* dst, int frames, int width, int add)
+{
+    /* As apply_gains(), for the float mixer: our buffer holds the resampler's
+     * ints unless we're a bus, in which case it holds stereo floats */
+    int i;
+    if(frames <= 0)
+    {
+        return;
+    }
+    float l = self->lgainf, r = self->rgainf;
+    float ls = (self->lgainfTarget - l) / frames;
+    float rs = (self->rgainfTarget - r) / frames;
+    if(self->onEvent)
+    {
+        const int* src = self->buf;
+        for(i = 0; i < frames; i++)
+        {
+            float xl = src[i * width] * (l + ls * i);
+            float xr = src[i * width + width - 1] * (r + rs * i);
+            dst[i * 2] = add ? dst[i * 2] + xl : xl;
+            dst[i * 2 + 1] = add ? dst[i * 2 + 1] + xr : xr;
+        }
+    }
+    else
+    {
+        const float* src = (const float*)self->buf;
+        for(i = 0; i < frames; i++)
+        {
+            float xl = src[i * 2] * (l + ls * i);
+            float xr = src[i * 2 + 1] * (r + rs * i);
+            dst[i * 2] = add ? dst[i * 2] + xl : xl;
+            dst[i * 2 + 1] = add ? dst[i * 2 + 1] + xr : xr;
+        }
+    }
+    self->lgainf = self->lgainfTarget;
+    self->rgainf = self->rgainfTarget;
+}
+
+static void apply_effects(Source* self, float* buf, int len)
+{
+    int i;
+    for(i = 0; i < SOURCE_EFFECT_MAX; i++)
+    {
+        if(self->effects[i])
+        {
+            dsp_process(self->effects[i], buf, len);
+        }
+    }
+}
+
+static void write_tap(SourceTap* tap, const void* buf, int isFloat, int frames)
+{
+    /* Downmixes our stereo output into the tap's ring; a NULL `buf` writes
+     * silence */
+    int i;
+    unsigned pos = SDL_AtomicGet(&tap->writePos);
+    const int* ibuf = buf;
+    const float* fbuf = buf;
+    for(i = 0; i < frames; i++)
+    {
+        float x = 0;
+        if(buf)
+        {
+            x = isFloat ? fbuf[i * 2] + fbuf[i * 2 + 1] : ibuf[i * 2] + ibuf[i * 2 + 1];
+        }
+        tap->buf[(pos + i) & SOURCE_TAP_MASK] = x * (0.5f / 32768);
+    }
+    SDL_AtomicSet(&tap->writePos, pos + frames);
+}
+
+static int effects_tail(Source* self)
+{
+    int i;
+    int n = 0;
+    for(i = 0; i < SOURCE_EFFECT_MAX; i++)
+    {
+        if(self->effects[i])
+        {
+            n = MAX(n, dsp_tail(self->effects[i]));
+        }
+    }
+    return n;
+}
+
+static void track_tail(Source* self, int fed, const float* buf, int len)
+{
+    /* Counts how long the effects have been silent -- under one 16-bit step --
+     * since the input stopped, so we know when their tails have died out */
+    int i;
+    if(fed)
+    {
+        return;
+    }
+    for(i = 0; i < len; i++)
+    {
+        if(buf[i] >= 1 || buf[i] <= -1)
+        {
+            self->quietFrames = 0;
+            return;
+        }
+    }
+    self->quietFrames += len / 2;
+}
+
+static int* get_dest_buffer(Source* self)
+{
+    if(!self->dest->buf)
+    {
+        self->dest->buf = acquire_buffer();
+    }
+    return self->dest->buf;
+}
+
+static void source_output_float(Source* self, int frames, int width, int fed)
+{
+    /* Float mixer counterpart of the end of source_process(): gains, effects
+     * and accumulation into the destination bus all happen in float */
+    int i;
+    int len = frames * 2;
+    float* dst = self->dest ? (float*)get_dest_buffer(self) : NULL;
+    int add = dst && !(self->dest->flags & SOURCE_FREPLACE);
+    float* out;
+    if(!self->effectMask && !self->tap && dst)
+    {
+        /* Straight into the destination */
+        apply_gains_float(self, dst, frames, width, add);
+        self->dest->flags &= ~SOURCE_FREPLACE;
+        return;
+    }
+    /* Buses apply gains and effects in place; sources with data need a float
+     * buffer to do so */
+    out = self->onEvent ? effectBuf : (float*)self->buf;
+    apply_gains_float(self, out, frames, width, 0);
+    apply_effects(self, out, len);
+    if(self->effectMask)
+    {
+        track_tail(self, fed, out, len);
+    }
+    if(self->tap)
+    {
+        write_tap(self->tap, out, 1, frames);
+    }
+    if(add)
+    {
+        for(i = 0; i < len; i++)
+        {
+            dst[i] += out[i];
+        }
+    }
+    else if(dst)
+    {
+        memcpy(dst, out, sizeof(*out) * len);
+    }
+    if(dst)
+    {
+        self->dest->flags &= ~SOURCE_FREPLACE;
+    }
+}
+
 static void source_process(Source* self, int len)
 {
     int i;
+    int frames = len / 2;
+    int playing = self->state == SOURCE_STATE_PLAYING && self->onEvent;
+    int start = 0;
+    /* Scheduled to start later? Stay silent up to the scheduled frame */
+    if(playing && self->startTime > audioClock)
+    {
+        if(self->startTime >= audioClock + frames)
+        {
+            playing = 0;
+        }
+        else
+        {
+            start = self->startTime - audioClock;
+        }
+    }
+    /* Not playing, nothing routed into us and no effect tails left to ring
+     * out? We have nothing to contribute, so we don't need a buffer either.
+     * The master always produces output */
+    int fed = playing || !(self->flags & SOURCE_FREPLACE);
+    if(fed)
+    {
+        self->quietFrames = 0;
+    }
+    else if(self != master
+        && (!self->effectMask || self->quietFrames > effects_tail(self)))
+    {
+        if(self->tap)
+        {
+            write_tap(self->tap, NULL, 0, frames);
+        }
+        self->flags &= ~SOURCE_FACTIVE;
+        release_buffer(self);
+        return;
+    }
+    if(!self->buf && !(self->buf = acquire_buffer()))
+    {
+        return;
+    }
+    /* Weren't audible last block? Start at the target gains rather than
+     * ramping from stale ones */
+    if(~self->flags & SOURCE_FACTIVE)
+    {
+        self->lgain = self->lgainTarget;
+        self->rgain = self->rgainTarget;
+        self->lgainf = self->lgainfTarget;
+        self->rgainf = self->rgainfTarget;
+        self->flags |= SOURCE_FACTIVE;
+    }
+    /* Mono sources mix into a mono buffer unless something was already routed
+     * into it */
+    int width = (self->channels == 1 && (self->flags & SOURCE_FREPLACE)) ? 1 : 2;
     /* Replace flag still set? Zeroset the buffer */
     if(self->flags & SOURCE_FREPLACE)
     {
-        memset(self->buf, 0, sizeof(*self->buf) * len);
+        memset(self->buf, 0, sizeof(*self->buf) * frames * width);
     }
     /* Process audio stream and add to our buffer */
-    if(self->state == SOURCE_STATE_PLAYING && self->onEvent)
+    if(playing)
     {
-        for(i = 0; i < len; i += 2)
+        blockVoices++;
+        self->startTime = 0;
+        i = start;
+        while(i < frames)
         {
-            int idx = (self->position >> FX_BITS);
-            /* Process the stream and fill the raw buffer if the next index requires
-             * samples we don't yet have */
-            if(idx + 1 >= self->bufEnd)
-            {
-                SourceEvent e = event(SOURCE_EVENT_PROCESS);
-                e.offset = (self->bufEnd) & SOURCE_BUFFER_MASK;
-                e.len = SOURCE_BUFFER_MAX / 2;
-                emit_event(self, &e);
-                self->bufEnd += e.len;
-            }
+            long long idx = self->position >> FX_BITS;
             /* Have we reached the end? */
             if(idx >= self->end)
             {
                 /* Not set to loop? Stop and stop processing */
-                if(~self->flags & SOURCE_FLOOP)
+                if((~self->flags & SOURCE_FLOOP) || self->length <= 0)
                 {
-                    self->state = SOURCE_STATE_STOPPED;
+                    stop_source(self);
                     break;
                 }
                 /* Set to loop: Streams always fill the raw buffer in a loop, so we
                  * just increment the end index by the stream's length so that it
                  * continues for another iteration of the sound file */
-                self->end = idx + self->length;
+                self->end += self->length;
+                continue;
+            }
+            /* Fetch more of the stream if the resampler requires samples we don't
+             * yet have */
+            int ahead = resampler_lookahead(self);
+            long long last = ((self->position + (long long)(frames - i) * self->rate) >> FX_BITS) + ahead;
+            if(idx + ahead >= self->bufEnd
+                && !fetch_frames(self, idx, idx + ahead, MAX(last, idx + ahead)))
+            {
+                /* Decoder hasn't caught up -- leave the rest silent. A queue
+                 * running dry is up to the game feeding it, not an underrun */
+                if(~self->flags & SOURCE_FQUEUE)
+                {
+                    SDL_AtomicAdd(&underruns, 1);
+                }
+                break;
+            }
+            /* Resample as many frames as we can before running out of decoded
+             * samples or reaching the end */
+            long long limit = MIN(self->bufEnd - ahead, self->end);
+            long long units = (limit << FX_BITS) - self->position;
+            int n = frames - i;
+            if(self->rate > 0)
+            {
+                n = MIN(n, (units + self->rate - 1) / self->rate);
             }
-            /* Write interpolated frame to buffer */
-            int p = self->position & FX_MASK;
-            /* Left */
-            int la = self->rawBufLeft[idx & SOURCE_BUFFER_MASK];
-            int lb = self->rawBufLeft[(idx + 1) & SOURCE_BUFFER_MASK];
-            self->buf[i] += FX_LERP(la, lb, p);
-            /* Right */
-            int ra = self->rawBufRight[idx & SOURCE_BUFFER_MASK];
-            int rb = self->rawBufRight[(idx + 1) & SOURCE_BUFFER_MASK];
-            self->buf[i + 1] += FX_LERP(ra, rb, p);
-            /* Increment position */
-            self->position += self->rate;
+            resample(self, self->buf + i * width, width, n);
+            i += n;
         }
+        /* Let the decoder reuse what we've consumed */
+        SDL_AtomicSet(&self->readPos, (unsigned)((self->position >> FX_BITS) - SOURCE_HISTORY));
     }
 
-    /* Apply gains */
-    for(i = 0; i < len; i += 2)
+    if(floatMixing)
     {
-        self->buf[i] = (self->buf[i] * self->lgain) >> FX_BITS;
-        self->buf[i + 1] = (self->buf[i + 1] * self->rgain) >> FX_BITS;
+        source_output_float(self, frames, width, fed);
+        self->flags |= SOURCE_FREPLACE;
+        return;
     }
-    /* Write to destination */
-    if(self->dest)
+
+    /* Mono without effects? Pan straight into the destination */
+    if(width == 1 && !self->effectMask && !self->tap)
     {
-        if(self->dest->flags & SOURCE_FREPLACE)
+        int* dst = self->dest ? get_dest_buffer(self) : NULL;
+        if(dst)
         {
-            memcpy(self->dest->buf, self->buf, sizeof(*self->buf) * len);
+            apply_gains(self, dst, frames, 1, !(self->dest->flags & SOURCE_FREPLACE));
             self->dest->flags &= ~SOURCE_FREPLACE;
         }
-        else
+        self->flags |= SOURCE_FREPLACE;
+        return;
+    }
+
+    /* Apply gains, spreading a mono buffer to stereo */
+    apply_gains(self, self->buf, frames, width, 0);
+    /* Apply effects -- after the gains so a limiter on the master sees the
+     * final level and tails ring out after a source is faded. They run in
+     * float, so convert around them */
+    if(self->effectMask)
+    {
+        for(i = 0; i < len; i++)
         {
-            for(i = 0; i < len; i++)
-            {
-                self->dest->buf[i] += self->buf[i];
-            }
+            effectBuf[i] = self->buf[i];
+        }
+        apply_effects(self, effectBuf, len);
+        track_tail(self, fed, effectBuf, len);
+        for(i = 0; i < len; i++)
+        {
+            float x = effectBuf[i];
+            self->buf[i] = (int)(x < 0 ? x - 0.5f : x + 0.5f);
+        }
+    }
+    if(self->tap)
+    {
+        write_tap(self->tap, self->buf, 0, frames);
+    }
+    /* Write to destination */
+    int* dst = self->dest ? get_dest_buffer(self) : NULL;
+    if(dst && (self->dest->flags & SOURCE_FREPLACE))
+    {
+        memcpy(dst, self->buf, sizeof(*self->buf) * len);
+        self->dest->flags &= ~SOURCE_FREPLACE;
+    }
+    else if(dst)
+    {
+        for(i = 0; i < len; i++)
+        {
+            dst[i] += self->buf[i];
         }
     }
     /* Reset our flag as to replace the buffer's content */
@@ -442,22 +2010,171 @@ void source_processAllSources(int len)
 {
     int i;
     Source* s;
-    /* Sources are processed in reverse (newer Sources are processed first) --
-     * this assures the master is processed last */
-    vec_foreach_rev(&sources, s, i)
+    /* Sources are processed in routing order -- this assures every bus and the
+     * master are processed after all of their inputs */
+    blockVoices = 0;
+    vec_foreach(&order, s, i)
+    {
+        source_process(s, len);
+    }
+    SDL_AtomicSet(&activeVoices, blockVoices);
+    /* Advance the clock */
+    SDL_AtomicLock(&clockLock);
+    audioClock += len / 2;
+    SDL_AtomicUnlock(&clockLock);
+    /* Wake the decoder to top up what we've just consumed */
+    if(SDL_AtomicGet(&decoderActive) && SDL_SemValue(decoderSem) == 0)
+    {
+        SDL_SemPost(decoderSem);
+    }
+}
+
+static void decode_all(int decode)
+{
+    int i;
+    Source* s;
+    /* Work from a copy of the list so the lock isn't held while decoding, which
+     * would keep init_source() waiting on the Lua thread. Sources are only
+     * freed after this thread hands them back, so none go away under us */
+    lock_decoder();
+    vec_clear(&decoderWork);
+    vec_extend(&decoderWork, &decoderSources);
+    unlock_decoder();
+    int dead = 0;
+    vec_foreach(&decoderWork, s, i)
+    {
+        /* Destroyed by the mixer? Deinit here, where the stream is owned */
+        if(SDL_AtomicGet(&s->dead))
+        {
+            SourceEvent e = event(SOURCE_EVENT_DEINIT);
+            emit_event(s, &e);
+            decoderWork.data[dead++] = s;
+        }
+        else if(decode)
+        {
+            decode_source(s, 0);
+        }
+    }
+    if(dead == 0)
+    {
+        return;
+    }
+    /* Take the dead off the list, then hand them back to be freed */
+    vec_truncate(&decoderWork, dead);
+    lock_decoder();
+    vec_foreach(&decoderWork, s, i)
+    {
+        vec_remove(&decoderSources, s);
+    }
+    unlock_decoder();
+    SDL_AtomicLock(&reapedLock);
+    vec_extend(&reaped, &decoderWork);
+    SDL_AtomicUnlock(&reapedLock);
+}
+
+static int decoder_thread(void* udata)
+{
+    (void)udata;
+    while(!SDL_AtomicGet(&decoderQuit))
+    {
+        SDL_SemWaitTimeout(decoderSem, 10);
+        decode_all(1);
+    }
+    return 0;
+}
+
+void source_startDecoder(void)
+{
+    if(decoder)
+        return;
+    if(!decoderSem)
+    {
+        decoderSem = SDL_CreateSemaphore(0);
+        decoderLock = SDL_CreateMutex();
+    }
+    SDL_AtomicSet(&decoderQuit, 0);
+    decoder = SDL_CreateThread(decoder_thread, "juno decoder", NULL);
+    if(decoder)
     {
-        source_process(s, len);
+        SDL_AtomicSet(&decoderActive, 1);
     }
 }
 
+void source_stopDecoder(void)
+{
+    if(!decoder)
+        return;
+    SDL_AtomicSet(&decoderQuit, 1);
+    SDL_SemPost(decoderSem);
+    SDL_WaitThread(decoder, NULL);
+    decoder = NULL;
+    SDL_AtomicSet(&decoderActive, 0);
+    /* Reap anything destroyed since the thread's last pass */
+    decode_all(0);
+}
+
 static int l_source_gc(lua_State* L)
 {
     Source* self = check_source(L, 1);
+    if(self->luaClaimed)
+    {
+        vec_remove(&claimed, self);
+    }
+    else if(!self->onEvent)
+    {
+        buses--;
+    }
+    for(int i = 0; i < SOURCE_EFFECT_MAX; i++)
+    {
+        retire_effect(self, i);
+    }
     Command c = command(COMMAND_DESTROY, self);
     push_command(&c);
     return 0;
 }
 
+static int init_source(lua_State* L, Source* self, int async)
+{
+    /* Init stream */
+    SourceEvent e = event(SOURCE_EVENT_INIT);
+    e.luaState = L;
+    emit_event(self, &e);
+    /* Init raw buffer -- sources decoded on the decoder thread get a deeper
+     * one so it can stay well ahead of the mixer. The stream may have asked
+     * for its own size in INIT */
+    int frames = async ? SOURCE_PREFETCH_MAX : SOURCE_BUFFER_MAX;
+    if(self->rawMask)
+    {
+        frames = self->rawMask + 1;
+    }
+    self->rawBuf[0] = calloc(frames * self->channels, sizeof(**self->rawBuf));
+    if(!self->rawBuf[0])
+    {
+        luaL_error(L, "out of memory");
+    }
+    self->rawBuf[1] = self->rawBuf[0] + (self->channels - 1) * frames;
+    self->rawMask = frames - 1;
+    /* The zeroed history before the first frame is the mixer's */
+    SDL_AtomicSet(&self->readPos, (unsigned)-SOURCE_HISTORY);
+    if(async)
+    {
+        self->flags |= SOURCE_FASYNC;
+        lock_decoder();
+        vec_push(&decoderSources, self);
+        unlock_decoder();
+    }
+    /* Init -- play() leaves a source that's still at the start as it is, so
+     * it needs its end from here */
+    self->end = (self->flags & SOURCE_FENDLESS) ? ENDLESS_END : self->length;
+    self->rate = get_baserate(self) * FX_UNIT;
+    self->dest = master;
+    self->luaDest = master;
+    /* Issue "add" command to push to `sources` vector */
+    Command c = command(COMMAND_ADD, self);
+    push_command(&c);
+    return 1;
+}
+
 static int l_source_fromData(lua_State* L)
 {
     Data* data = (Data*)luaL_checkudata(L, 1, DATA_CLASS_NAME);
@@ -472,30 +2189,238 @@ static int l_source_fromData(lua_State* L)
     if(data->len > 12 && !memcmp(((char *)data->data) + 8, "WAVE", 4))
     {
         self->onEvent = onevent_wav;
-        goto init;
+        return init_source(L, self, 0);
     }
     /* Is .ogg? */
     if(data->len > 4 && !memcmp(data->data, "OggS", 4))
     {
         self->onEvent = onevent_ogg;
-        goto init;
+        return init_source(L, self, 1);
     }
     /* Made it here? Error out because we couldn't detect the format */
-    luaL_error(L, "could not init Source; bad Data format?");
-    /* Init stream */
-init:;
-    SourceEvent e = event(SOURCE_EVENT_INIT);
-    e.luaState = L;
-    emit_event(self, &e);
-    /* Init */
-    self->rate = get_baserate(self) * FX_UNIT;
+    return luaL_error(L, "could not init Source; bad Data format?");
+}
+
+static int l_source_fromFile(lua_State* L)
+{
+    const char* filename = luaL_checkstring(L, 1);
+    int stream = 0;
+    if(lua_istable(L, 2))
+    {
+        lua_getfield(L, 2, "stream");
+        stream = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+    }
+    /* Not streaming? Load the whole file as Data */
+    if(!stream)
+    {
+        luaL_getmetatable(L, DATA_CLASS_NAME);
+        lua_getfield(L, -1, "fromFile");
+        lua_pushvalue(L, 1);
+        lua_call(L, 1, 1);
+        lua_replace(L, 1);
+        lua_settop(L, 1);
+        return l_source_fromData(L);
+    }
+    /* Open stream and sniff the format from the first bytes */
+    char header[12];
+    fs_Stream* fs = fs_openStream(filename);
+    if(!fs)
+    {
+        luaL_error(L, "could not open file '%s'", filename);
+    }
+    size_t n = fs_readStream(fs, header, sizeof(header));
+    fs_seekStream(fs, 0);
+    SourceEventHandler onEvent = NULL;
+    /* Is .wav? */
+    if(n == 12 && !memcmp(header + 8, "WAVE", 4))
+    {
+        onEvent = onevent_wavstream;
+    }
+    /* Is .ogg? */
+    else if(n >= 4 && !memcmp(header, "OggS", 4))
+    {
+        onEvent = onevent_oggstream;
+    }
+    else
+    {
+        fs_closeStream(fs);
+        luaL_error(L, "could not init Source; bad file format?");
+    }
+    Source* self = new_source(L);
+    self->stream = fs;
+    self->onEvent = onEvent;
+    return init_source(L, self, 1);
+}
+
+static int l_source_newSynth(lua_State* L)
+{
+    static const char* waves[] = {
+        "square", "triangle", "saw", "noise", "wavetable", NULL
+    };
+    int wave = luaL_checkoption(L, 1, NULL, waves);
+    short* table = NULL;
+    /* Wavetable? Stretch the given samples (-1 to 1) over a full table */
+    if(wave == SOURCE_WAVE_WAVETABLE)
+    {
+        luaL_checktype(L, 2, LUA_TTABLE);
+        int n = lua_objlen(L, 2);
+        if(n < 1)
+        {
+            luaL_argerror(L, 2, "expected a non-empty table of samples");
+        }
+        table = malloc(SOURCE_WAVETABLE_SIZE * sizeof(*table));
+        if(!table)
+        {
+            luaL_error(L, "out of memory");
+        }
+        for(int i = 0; i < SOURCE_WAVETABLE_SIZE; i++)
+        {
+            double p = (double)i * n / SOURCE_WAVETABLE_SIZE;
+            int j = p;
+            lua_rawgeti(L, 2, j + 1);
+            lua_rawgeti(L, 2, (j + 1) % n + 1);
+            double a = lua_tonumber(L, -2), b = lua_tonumber(L, -1);
+            lua_pop(L, 2);
+            double x = a + (b - a) * (p - j);
+            table[i] = CLAMP(x, -1, 1) * 32767;
+        }
+    }
+    Source* self = new_source(L);
+    self->onEvent = onevent_synth;
+    self->synthWave = wave;
+    self->synthTable = table;
+    return init_source(L, self, 0);
+}
+
+static int l_source_newQueue(lua_State* L)
+{
+    static const char* formats[] = { "int16", "float", NULL };
+    int channels = 2;
+    int rate = samplerate;
+    int frames = SOURCE_QUEUE_DEFAULT;
+    int format = 0;
+    if(lua_istable(L, 1))
+    {
+        lua_getfield(L, 1, "channels");
+        channels = luaL_optint(L, -1, channels);
+        lua_getfield(L, 1, "rate");
+        rate = luaL_optint(L, -1, rate);
+        lua_getfield(L, 1, "frames");
+        frames = luaL_optint(L, -1, frames);
+        lua_getfield(L, 1, "format");
+        format = luaL_checkoption(L, -1, "int16", formats);
+        lua_pop(L, 4);
+    }
+    if(channels != 1 && channels != 2)
+    {
+        luaL_error(L, "expected 1 or 2 channels");
+    }
+    if(rate <= 0)
+    {
+        luaL_error(L, "expected rate greater than 0");
+    }
+    if(frames < 256 || frames > SOURCE_QUEUE_MAX || (frames & (frames - 1)))
+    {
+        luaL_error(L, "expected frames to be a power of 2 between 256 and %d",
+            SOURCE_QUEUE_MAX);
+    }
+    Source* self = new_source(L);
+    self->onEvent = onevent_queue;
+    self->channels = channels;
+    self->samplerate = rate;
+    self->rawMask = frames - 1;
+    self->queueFloat = format;
+    return init_source(L, self, 0);
+}
+
+static int l_source_newBus(lua_State* L)
+{
+    /* A bus is a source without any data of its own -- it only mixes the
+     * sources routed into it and applies its gain and pan */
+    Source* self = new_source(L);
     self->dest = master;
-    /* Issue "add" command to push to `sources` vector */
+    self->luaDest = master;
+    buses++;
     Command c = command(COMMAND_ADD, self);
     push_command(&c);
     return 1;
 }
 
+static int l_source_setDestination(lua_State* L)
+{
+    Source* self = check_source(L, 1);
+    Source* dest = lua_isnoneornil(L, 2) ? master : check_source(L, 2);
+    if(self == master)
+    {
+        luaL_error(L, "cannot set the destination of the master");
+    }
+    /* Only buses and the master take inputs: with the float mixer they hold
+     * floats, which a source's own samples can't be mixed into. Routing into a
+     * source with data of its own was allowed before buses existed */
+    if(dest->onEvent)
+    {
+        luaL_error(L, "destination must be a bus or the master");
+    }
+    /* `luaDest` mirrors the routing on this thread so loops can be refused
+     * before they ever reach the mixer */
+    for(Source* s = dest; s; s = s->luaDest)
+    {
+        if(s == self)
+        {
+            luaL_error(L, "destination would route the source into itself");
+        }
+    }
+    self->luaDest = dest;
+    Command c = command(COMMAND_SET_DESTINATION, self);
+    c.p = dest;
+    c.i = LUA_NOREF;
+    if(dest != master)
+    {
+        lua_pushvalue(L, 2);
+        c.i = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    push_command(&c);
+    return 0;
+}
+
+static int l_source_setPan(lua_State* L)
+{
+    Source* self = check_source(L, 1);
+    Command c = command(COMMAND_SET_PAN, self);
+    c.f = luaL_checknumber(L, 2);
+    push_command(&c);
+    return 0;
+}
+
+static int l_source_setPosition(lua_State* L)
+{
+    Source* self = check_source(L, 1);
+    Command c = command(COMMAND_SET_POSITION, self);
+    /* No position? The source is no longer positional */
+    if(!lua_isnoneornil(L, 2))
+    {
+        c.i = 1;
+        c.f = luaL_checknumber(L, 2);
+        c.f2 = luaL_checknumber(L, 3);
+    }
+    push_command(&c);
+    return 0;
+}
+
+static int l_source_setAttenuation(lua_State* L)
+{
+    static const char* models[] = { "linear", "inverse", "exponential", NULL };
+    Source* self = check_source(L, 1);
+    Command c = command(COMMAND_SET_ATTENUATION, self);
+    c.i = luaL_checkoption(L, 2, "inverse", models);
+    c.v[0] = MAX(luaL_optnumber(L, 3, 1), 1e-9);
+    c.v[1] = luaL_optnumber(L, 4, 1e30);
+    c.v[2] = MAX(luaL_optnumber(L, 5, 1), 0);
+    push_command(&c);
+    return 0;
+}
+
 static int l_source_setLoop(lua_State* L)
 {
     Source* self = check_source(L, 1);
@@ -516,6 +2441,123 @@ static int l_source_setGain(lua_State* L)
     return 0;
 }
 
+static int l_source_setRate(lua_State* L)
+{
+    Source* self = check_source(L, 1);
+    double rate = luaL_optnumber(L, 2, 1.);
+    Command c = command(COMMAND_SET_RATE, self);
+    c.f = MAX(rate, 0);
+    push_command(&c);
+    return 0;
+}
+
+static int l_source_setQuality(lua_State* L)
+{
+    const char* modes[] = { "nearest", "linear", "cubic", "sinc", NULL };
+    Source* self = check_source(L, 1);
+    Command c = command(COMMAND_SET_QUALITY, self);
+    c.i = luaL_checkoption(L, 2, "linear", modes);
+    if(c.i == SOURCE_QUALITY_SINC)
+    {
+        init_sinc_tables();
+    }
+    push_command(&c);
+    return 0;
+}
+
+static void get_effect_param(lua_State* L, int idx, const char* key, double* res)
+{
+    if(!lua_istable(L, idx))
+        return;
+    lua_getfield(L, idx, key);
+    if(!lua_isnil(L, -1))
+    {
+        if(!lua_isnumber(L, -1))
+        {
+            luaL_error(L, "expected number for effect parameter '%s'", key);
+        }
+        *res = lua_tonumber(L, -1);
+    }
+    lua_pop(L, 1);
+}
+
+static int l_source_setEffect(lua_State* L)
+{
+    static const char* names[] = {
+        "lowpass", "highpass", "bandpass", "delay", "compressor", "limiter", "reverb", NULL
+    };
+    static const int types[] = {
+        DSP_LOWPASS, DSP_HIGHPASS, DSP_BANDPASS, DSP_DELAY, DSP_COMPRESSOR, DSP_COMPRESSOR, DSP_REVERB
+    };
+    Source* self = check_source(L, 1);
+    int slot = luaL_checkint(L, 2) - 1;
+    luaL_argcheck(L, slot >= 0 && slot < SOURCE_EFFECT_MAX, 2, "effect slot out of range");
+    Command c = command(COMMAND_SET_EFFECT, self);
+    c.i = slot;
+    /* No effect type? Clear the slot */
+    if(lua_isnoneornil(L, 3))
+    {
+        if(self->luaEffects[slot])
+        {
+            retire_effect(self, slot);
+            self->luaEffects[slot] = 0;
+            self->luaEffectPtrs[slot] = NULL;
+            update_claim(L, self);
+            push_command(&c);
+        }
+        return 0;
+    }
+    int opt = luaL_checkoption(L, 3, NULL, names);
+    int limiter = !strcmp(names[opt], "limiter");
+    /* Init parameters: defaults overridden by the table's fields */
+    dsp_Params p;
+    memset(&p, 0, sizeof(p));
+    p.cutoff = 1000;
+    p.q = 0.7071;
+    p.time = 0.25;
+    p.feedback = 0.4;
+    p.mix = types[opt] == DSP_REVERB ? 0.25 : 0.3;
+    p.threshold = limiter ? -1 : -12;
+    p.ratio = limiter ? HUGE_VAL : 4;
+    p.attack = limiter ? 0.001 : 0.005;
+    p.release = limiter ? 0.05 : 0.1;
+    p.size = 0.5;
+    p.damping = 0.5;
+    get_effect_param(L, 4, "cutoff", &p.cutoff);
+    get_effect_param(L, 4, "q", &p.q);
+    get_effect_param(L, 4, "time", &p.time);
+    get_effect_param(L, 4, "feedback", &p.feedback);
+    get_effect_param(L, 4, "mix", &p.mix);
+    get_effect_param(L, 4, "threshold", &p.threshold);
+    get_effect_param(L, 4, "ratio", &p.ratio);
+    get_effect_param(L, 4, "attack", &p.attack);
+    get_effect_param(L, 4, "release", &p.release);
+    get_effect_param(L, 4, "makeup", &p.makeup);
+    get_effect_param(L, 4, "size", &p.size);
+    get_effect_param(L, 4, "damping", &p.damping);
+    /* Same type already in the slot? Just update its parameters so delay lines
+     * and filter state carry on */
+    if(self->luaEffects[slot] == types[opt] + 1)
+    {
+        c.type = COMMAND_SET_EFFECT_PARAMS;
+        c.params = p;
+        push_command(&c);
+        return 0;
+    }
+    reserve_buffers(L, self->onEvent && !self->luaClaimed);
+    c.p = dsp_new(types[opt], &p, samplerate);
+    if(!c.p)
+    {
+        luaL_error(L, "out of memory");
+    }
+    retire_effect(self, slot);
+    self->luaEffects[slot] = types[opt] + 1;
+    self->luaEffectPtrs[slot] = c.p;
+    update_claim(L, self);
+    push_command(&c);
+    return 0;
+}
+
 static int l_source_getState(lua_State* L)
 {
     Source* self = check_source(L, 1);
@@ -540,17 +2582,167 @@ static int l_source_getState(lua_State* L)
 static int l_source_play(lua_State* L)
 {
     Source* self = check_source(L, 1);
-    int reset = luax_optboolean(L, 2, 0);
     Command c = command(COMMAND_PLAY, self);
-    c.i = reset;
+    /* Options table? `at` schedules playback on the audio clock */
+    if(lua_istable(L, 2))
+    {
+        lua_getfield(L, 2, "reset");
+        c.i = lua_toboolean(L, -1);
+        lua_getfield(L, 2, "at");
+        if(!lua_isnil(L, -1))
+        {
+            if(!lua_isnumber(L, -1))
+            {
+                luaL_error(L, "expected number for option 'at'");
+            }
+            c.f = lua_tonumber(L, -1) * source_getSamplerate();
+        }
+        lua_pop(L, 2);
+    }
+    else
+    {
+        c.i = luax_optboolean(L, 2, 0);
+    }
+    set_playing(L, self, 1);
+    push_command(&c);
+    return 0;
+}
+
+static Source* check_synth(lua_State* L, int idx)
+{
+    Source* self = check_source(L, idx);
+    if(self->onEvent != onevent_synth)
+    {
+        luaL_argerror(L, idx, "expected a synth Source");
+    }
+    return self;
+}
+
+static int l_source_noteOn(lua_State* L)
+{
+    Source* self = check_synth(L, 1);
+    Command c = command(COMMAND_NOTE_ON, self);
+    c.f = luaL_checknumber(L, 2);
+    c.f2 = luaL_optnumber(L, 3, 1);
+    if(c.f < 0 || c.f >= self->samplerate / 2)
+    {
+        luaL_argerror(L, 2, "frequency out of range");
+    }
+    set_playing(L, self, 1);
+    push_command(&c);
+    return 0;
+}
+
+static int l_source_noteOff(lua_State* L)
+{
+    Source* self = check_synth(L, 1);
+    Command c = command(COMMAND_NOTE_OFF, self);
+    push_command(&c);
+    return 0;
+}
+
+static int l_source_setEnvelope(lua_State* L)
+{
+    Source* self = check_synth(L, 1);
+    Command c = command(COMMAND_SET_ENVELOPE, self);
+    for(int i = 0; i < 4; i++)
+    {
+        c.v[i] = luaL_checknumber(L, i + 2);
+    }
+    push_command(&c);
+    return 0;
+}
+
+static int l_source_setDuty(lua_State* L)
+{
+    Source* self = check_synth(L, 1);
+    Command c = command(COMMAND_SET_DUTY, self);
+    c.f = luaL_checknumber(L, 2);
     push_command(&c);
     return 0;
 }
 
+static Source* check_queue(lua_State* L, int idx)
+{
+    Source* self = check_source(L, idx);
+    if(self->onEvent != onevent_queue)
+    {
+        luaL_argerror(L, idx, "expected a queue Source");
+    }
+    return self;
+}
+
+static int queue_free_space(Source* self)
+{
+    /* The mixer's read position lags by the resampler's history, so those
+     * frames are kept too */
+    int used = (unsigned)SDL_AtomicGet(&self->fillEnd) - SDL_AtomicGet(&self->readPos);
+    return MAX(self->rawMask + 1 - used, 0);
+}
+
+static int l_source_queue(lua_State* L)
+{
+    Source* self = check_queue(L, 1);
+    const char* p;
+    size_t len;
+    if(lua_type(L, 2) == LUA_TSTRING)
+    {
+        p = lua_tolstring(L, 2, &len);
+    }
+    else
+    {
+        Data* data = (Data*)luaL_checkudata(L, 2, DATA_CLASS_NAME);
+        p = data->data;
+        len = data->len;
+    }
+    /* Only as many whole frames as there's room for; the number queued is
+     * returned so the caller can hold on to the rest */
+    int frameSize = self->channels * (self->queueFloat ? sizeof(float) : sizeof(short));
+    int frames = MIN((int)(len / frameSize), queue_free_space(self));
+    unsigned pos = SDL_AtomicGet(&self->fillEnd);
+    int stride = self->channels;
+    int last = self->channels - 1;
+    if(self->queueFloat)
+    {
+        const float* src = (const float*)p;
+        for(int i = 0; i < frames; i++)
+        {
+            int idx = (pos + i) & self->rawMask;
+            float l = CLAMP(src[i * stride], -1, 1);
+            float r = CLAMP(src[i * stride + last], -1, 1);
+            self->rawBuf[0][idx] = l * 32767;
+            self->rawBuf[1][idx] = r * 32767;
+        }
+    }
+    else
+    {
+        const short* src = (const short*)p;
+        for(int i = 0; i < frames; i++)
+        {
+            int idx = (pos + i) & self->rawMask;
+            self->rawBuf[0][idx] = src[i * stride];
+            self->rawBuf[1][idx] = src[i * stride + last];
+        }
+    }
+    /* Publish */
+    SDL_AtomicSet(&self->fillEnd, pos + frames);
+    lua_pushinteger(L, frames);
+    return 1;
+}
+
+static int l_source_getFreeSpace(lua_State* L)
+{
+    Source* self = check_queue(L, 1);
+    lua_pushinteger(L, queue_free_space(self));
+    return 1;
+}
+
 static int l_source_pause(lua_State* L)
 {
     Source* self = check_source(L, 1);
     Command c = command(COMMAND_PAUSE, self);
+    /* May resume it */
+    set_playing(L, self, 1);
     push_command(&c);
     return 0;
 }
@@ -559,19 +2751,128 @@ static int l_source_stop(lua_State* L)
 {
     Source* self = check_source(L, 1);
     Command c = command(COMMAND_STOP, self);
+    set_playing(L, self, 0);
     push_command(&c);
     return 0;
 }
 
+static SourceTap* get_tap(lua_State* L, Source* self)
+{
+    /* The tap is only created once something asks for it, so the first reads
+     * return silence */
+    if(!self->luaTap)
+    {
+        SourceTap* tap = calloc(1, sizeof(*tap));
+        if(!tap)
+        {
+            luaL_error(L, "out of memory");
+        }
+        Command c = command(COMMAND_SET_TAP, self);
+        c.p = tap;
+        push_command(&c);
+        self->luaTap = tap;
+    }
+    return self->luaTap;
+}
+
+static void read_tap(SourceTap* tap, float* dst, int n)
+{
+    /* Copies the `n` most recent samples. A callback mixes as many blocks as
+     * the device asks for, so the mixer may lap us while we copy: check the
+     * position again afterwards, allowing for a block being written that
+     * hasn't been published yet, and start over if it did */
+    for(;;)
+    {
+        unsigned pos = SDL_AtomicGet(&tap->writePos) - n;
+        for(int i = 0; i < n; i++)
+        {
+            dst[i] = tap->buf[(pos + i) & SOURCE_TAP_MASK];
+        }
+        unsigned end = SDL_AtomicGet(&tap->writePos);
+        if(end - pos <= SOURCE_TAP_SIZE - SOURCE_BUFFER_MAX / 2)
+            break;
+    }
+}
+
+static int l_source_getSpectrum(lua_State* L)
+{
+    static float samples[DSP_FFT_MAX];
+    static float bins[DSP_FFT_MAX / 2];
+    Source* self = check_source(L, 1);
+    int n = luaL_optint(L, 2, 1024);
+    if(n < 16 || n > DSP_FFT_MAX || (n & (n - 1)))
+    {
+        luaL_argerror(L, 2, "expected a power of 2 between 16 and 4096");
+    }
+    /* Reuse the table we were given */
+    if(lua_istable(L, 3))
+    {
+        lua_settop(L, 3);
+    }
+    else
+    {
+        lua_createtable(L, n / 2, 0);
+    }
+    read_tap(get_tap(L, self), samples, n);
+    dsp_spectrum(samples, bins, n);
+    for(int i = 0; i < n / 2; i++)
+    {
+        lua_pushnumber(L, bins[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+    return 1;
+}
+
+static int l_source_getLevels(lua_State* L)
+{
+    static float samples[SOURCE_TAP_SIZE / 2];
+    Source* self = check_source(L, 1);
+    int n = luaL_optint(L, 2, 1024);
+    if(n < 1 || n > SOURCE_TAP_SIZE / 2)
+    {
+        luaL_argerror(L, 2, "sample count out of range");
+    }
+    read_tap(get_tap(L, self), samples, n);
+    double sum = 0;
+    float peak = 0;
+    for(int i = 0; i < n; i++)
+    {
+        sum += samples[i] * samples[i];
+        peak = MAX(peak, fabsf(samples[i]));
+    }
+    lua_pushnumber(L, sqrt(sum / n));
+    lua_pushnumber(L, peak);
+    return 2;
+}
+
 static const luaL_Reg reg[] = {
     { "__gc", l_source_gc },
     { "fromData", l_source_fromData },
+    { "fromFile", l_source_fromFile },
+    { "newBus", l_source_newBus },
+    { "newSynth", l_source_newSynth },
+    { "newQueue", l_source_newQueue },
+    { "setDestination", l_source_setDestination },
     { "getState", l_source_getState },
     { "setLoop", l_source_setLoop },
     { "setGain", l_source_setGain },
+    { "setRate", l_source_setRate },
+    { "setQuality", l_source_setQuality },
+    { "setEffect", l_source_setEffect },
+    { "setPan", l_source_setPan },
+    { "setPosition", l_source_setPosition },
+    { "setAttenuation", l_source_setAttenuation },
     { "play", l_source_play },
     { "pause", l_source_pause },
     { "stop", l_source_stop },
+    { "noteOn", l_source_noteOn },
+    { "noteOff", l_source_noteOff },
+    { "setEnvelope", l_source_setEnvelope },
+    { "setDuty", l_source_setDuty },
+    { "queue", l_source_queue },
+    { "getFreeSpace", l_source_getFreeSpace },
+    { "getSpectrum", l_source_getSpectrum },
+    { "getLevels", l_source_getLevels },
     { NULL, NULL }
 };
 
@@ -585,6 +2886,7 @@ int luaopen_source(lua_State* L)
     /* Init master */
     master = new_source(L);
     masterRef = luaL_ref(L, LUA_REGISTRYINDEX);
+    buses++;
     Command c = command(COMMAND_ADD, master);
     push_command(&c);
     return 1;
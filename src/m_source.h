@@ -1,9 +1,13 @@
 #ifndef M_SOURCE_H
 #define M_SOURCE_H
 
+#include <SDL.h>
+
 #include "luax.h"
 #include "wav.h"
 #include "m_data.h"
+#include "fs.h"
+#include "dsp.h"
 
 #define STB_VORBIS_HEADER_ONLY
 #include "stb_vorbis.c"
@@ -13,20 +17,46 @@
 
 #define SOURCE_BUFFER_MAX 4096
 #define SOURCE_BUFFER_MASK (SOURCE_BUFFER_MAX - 1)
+#define SOURCE_PREFETCH_MAX 16384
+#define SOURCE_STREAM_WINDOW 65536
+#define SOURCE_EFFECT_MAX 4
+#define SOURCE_TAP_SIZE 8192
+#define SOURCE_TAP_MASK (SOURCE_TAP_SIZE - 1)
+#define SOURCE_SYNTH_BUFFER 256
+#define SOURCE_WAVETABLE_BITS 8
+#define SOURCE_WAVETABLE_SIZE (1 << SOURCE_WAVETABLE_BITS)
+#define SOURCE_QUEUE_DEFAULT 16384
+#define SOURCE_QUEUE_MAX (1 << 20)
 
 struct Source;
+
+/* Analysis tap: a ring of the source's most recent output, downmixed to mono
+ * and normalized to -1..1. Only the audio thread writes to it; readers copy out
+ * behind `writePos` */
+typedef struct
+{
+    float buf[SOURCE_TAP_SIZE];
+    SDL_atomic_t writePos;
+} SourceTap;
 struct SourceEvent;
 
 typedef void (*SourceEventHandler)(struct Source*, struct SourceEvent*);
 
 typedef struct Source
 {
-    int rawBufLeft[SOURCE_BUFFER_MAX];
-    int rawBufRight[SOURCE_BUFFER_MAX];
-    int buf[SOURCE_BUFFER_MAX];
+    /* Raw samples, one plane per channel; mono sources stay mono until they
+     * are panned into their destination */
+    short* rawBuf[2];
+    int channels;
+    int rawMask;
+    /* Mix buffer, taken from a shared pool only while the source is active.
+     * With the float mixer, buses (and the master) hold floats in it */
+    int* buf;
     int dataRef, destRef;
     Data* data;
     struct Source* dest;
+    struct Source* luaDest;
+    int depth;
     SourceEventHandler onEvent;
     int samplerate;
     int state;
@@ -34,10 +64,44 @@ typedef struct Source
     int length;
     int rate;
     long long position;
-    int end;
-    int bufEnd;
+    long long startTime;
+    long long end;
+    long long bufEnd;
     int lgain, rgain;
+    int lgainTarget, rgainTarget;
+    float lgainf, rgainf;
+    float lgainfTarget, rgainfTarget;
+    int quality;
     double gain, pan;
+    /* Position -- only used with SOURCE_FPOSITIONAL */
+    double x, y;
+    int attenuation;
+    double refDistance, maxDistance, rolloff;
+    /* Effects -- `luaEffects` and `luaEffectPtrs` mirror the slots on the Lua
+     * thread */
+    dsp_Effect* effects[SOURCE_EFFECT_MAX];
+    int effectMask;
+    /* Frames of silence the effects have put out since our input stopped */
+    int quietFrames;
+    int luaEffects[SOURCE_EFFECT_MAX];
+    dsp_Effect* luaEffectPtrs[SOURCE_EFFECT_MAX];
+    /* Analysis tap, created on first use -- `luaTap` is the Lua thread's copy
+     * of the pointer */
+    SourceTap* tap;
+    SourceTap* luaTap;
+    /* The Lua thread's view of whether the source may need a mix buffer, used
+     * to size the pool */
+    int luaPlaying, luaPlayBatch, luaClaimed;
+    /* Decoding -- the raw buffer is filled either inline by the mixer or by the
+     * decoder thread for SOURCE_FASYNC sources; the atomics are the only state
+     * shared between the two */
+    unsigned writePos;
+    int decodeGen;
+    SDL_atomic_t fillEnd;
+    SDL_atomic_t readPos;
+    SDL_atomic_t seekGen;
+    SDL_atomic_t readyGen;
+    SDL_atomic_t dead;
     /* Type-specific fields */
     union
     {
@@ -52,6 +116,39 @@ typedef struct Source
         {
             stb_vorbis* oggStream;
         };
+        /* Streamed .wav/.ogg */
+        struct
+        {
+            fs_Stream* stream;
+            stb_vorbis* streamOgg;
+            wav_t streamWav;
+            size_t streamDataOfs;
+            unsigned char* streamBuf;
+            int streamBufPos, streamBufLen;
+            float** streamOut;
+            int streamOutIdx, streamOutLen;
+            int streamIdx;
+            int streamChannels;
+        };
+        /* Synth -- the phase is a 32bit fraction of a cycle; envelope steps
+         * are per frame */
+        struct
+        {
+            int synthWave;
+            unsigned synthPhase, synthInc, synthDuty;
+            unsigned synthNoise;
+            short* synthTable;
+            int synthStage;
+            long long synthFrame;
+            float synthEnv, synthVelocity;
+            float synthAttack, synthDecay, synthSustain, synthRelease;
+        };
+        /* Queue -- Lua writes frames straight into the raw buffer and
+         * publishes them through `fillEnd` */
+        struct
+        {
+            int queueFloat;
+        };
     };
 } Source;
 
@@ -65,6 +162,12 @@ typedef struct SourceEvent
 
 #define SOURCE_FLOOP (1 << 0)
 #define SOURCE_FREPLACE (1 << 1)
+#define SOURCE_FASYNC (1 << 2)
+#define SOURCE_FPOSITIONAL (1 << 3)
+#define SOURCE_FACTIVE (1 << 4)
+#define SOURCE_FQUEUE (1 << 5)
+#define SOURCE_FENDLESS (1 << 6)
+#define SOURCE_FLIVE (1 << 7)
 
 enum
 {
@@ -73,6 +176,30 @@ enum
     SOURCE_STATE_PAUSED,
 };
 
+enum
+{
+    SOURCE_QUALITY_NEAREST,
+    SOURCE_QUALITY_LINEAR,
+    SOURCE_QUALITY_CUBIC,
+    SOURCE_QUALITY_SINC,
+};
+
+enum
+{
+    SOURCE_ATTENUATION_LINEAR,
+    SOURCE_ATTENUATION_INVERSE,
+    SOURCE_ATTENUATION_EXPONENTIAL,
+};
+
+enum
+{
+    SOURCE_WAVE_SQUARE,
+    SOURCE_WAVE_TRIANGLE,
+    SOURCE_WAVE_SAW,
+    SOURCE_WAVE_NOISE,
+    SOURCE_WAVE_WAVETABLE,
+};
+
 enum
 {
     SOURCE_EVENT_NULL,
@@ -84,7 +211,21 @@ enum
 
 Source* source_getMaster(int* ref);
 void source_setSamplerate(int sr);
+int source_getSamplerate(void);
+void source_setBufferSize(int frames);
+void source_setFloatMixing(int enable);
+int source_getFloatMixing(void);
+void source_setDirect(lua_State* L);
+int source_getBufferSize(void);
+double source_getDecodeTime(void);
+double source_getTime(void);
+void source_setListener(double x, double y);
+int source_getActiveVoices(void);
+int source_getUnderruns(void);
 void source_processCommands(lua_State* L);
+void source_update(void);
 void source_processAllSources(int len);
+void source_startDecoder(void);
+void source_stopDecoder(void);
 
 #endif
\ No newline at end of file